@@ -6,86 +6,20 @@ require 'yaml'
 
 require 'ultragrep/config'
 require 'ultragrep/log_collector'
+require 'ultragrep/request_printer'
+require 'ultragrep/agent'
+require 'ultragrep/scheduler'
+require 'ultragrep/throttle'
 
 module Ultragrep
   HOUR = 60 * 60
   DAY = 24 * HOUR
-
-  class RequestPrinter
-    def initialize(verbose)
-      @mutex = Mutex.new
-      @all_data = []
-      @children_timestamps = {}
-      @finish = false
-      @verbose = verbose
-    end
-
-    def dump_buffer
-      dump_this = []
-      new_data = []
-
-      @mutex.synchronize do
-        to_this_ts = @children_timestamps.values.min || 0 # FIXME : should not be necessary, but fails with -t -p
-        $stderr.puts("I've searched up through #{Time.at(to_this_ts)}") if @verbose && to_this_ts > 0 && to_this_ts != 2**50
-        @all_data.each do |req|
-          if req[0] <= to_this_ts
-            dump_this << req
-          else
-            new_data << req
-          end
-        end
-        @all_data = new_data
-      end
-
-      STDOUT.write(dump_this.sort.map(&:last).join)
-      STDOUT.flush
-    end
-
-    def run
-      Thread.new do
-        while @all_data.size > 0 || !@finish
-          sleep 2
-          dump_buffer
-        end
-        dump_buffer
-      end
-    end
-
-    def add_request(parsed_up_to, text)
-      @mutex.synchronize do
-        if text = format_request(parsed_up_to, text)
-          @all_data << [parsed_up_to, text]
-        end
-      end
-    end
-
-    def format_request(parsed_up_to, text)
-      text.join
-    end
-
-    def set_read_up_to(key, val)
-      @mutex.synchronize { @children_timestamps[key] = val }
-    end
-
-    def set_done(key)
-      @mutex.synchronize { @children_timestamps[key] = 2**50 }
-    end
-
-    def finish
-      @finish = true
-      dump_buffer
-    end
-  end
-
-  class RequestPerformancePrinter < RequestPrinter
-    def format_request(parsed_up_to, req)
-      text = req.join
-      return unless text =~ /.*Processing ([^ ]+) .*Completed in (\d+)ms/m
-      action = $1
-      time = $2
-      "#{parsed_up_to}\t#{action}\t#{time}\n"
-    end
-  end
+  # what --estimate assumes a search gets through, per concurrent file, unless scan_mb_per_sec says otherwise
+  DEFAULT_SCAN_MB_PER_SEC = 100
+  # and how much bigger than on disk it takes compressed logs to be
+  COMPRESSION_RATIO = 8
+  # what happens when a regexp runs out of backtracking on a request: it's left out, or the search stops
+  MATCH_LIMIT_POLICIES = %w(skip abort)
 
   class << self
     def parse_args(argv)
@@ -150,10 +84,33 @@ module Ultragrep
           options[:range_start] = parse_time(date) - 10
           options[:range_end] = parse_time(date) + 10
         end
+        parser.on("--max-count", "-m COUNT", Integer, "Stop after the first COUNT matching requests") do |count|
+          options[:max_count] = count
+        end
+        parser.on("--reverse", "-r", "Newest requests first -- with --max-count, the last COUNT of them") { options[:reverse] = true }
+        parser.on("--estimate SECONDS", Float, "Don't print requests, estimate how many match from what can be read in about SECONDS") do |seconds|
+          options[:estimate] = seconds
+        end
+        parser.on("--key", "-k KEY=VALUE", String, "Only JSON records whose KEY (a.b for nested ones) passes, also with !=, <, >, <=, >=") do |test|
+          options[:keys] ||= []
+          options[:keys] << test
+        end
+        parser.on("--where TEST", String, "Only requests whose meta field passes TEST, like status=500 or duration>2000") do |test|
+          options[:where] ||= []
+          options[:where] << test
+        end
+        parser.on("--stats", "Show how each regexp did, and the order they ended up being tested in, on STDERR") { options[:stats] = true }
+        parser.on("--match-limit STEPS", Integer, "Give each regexp this many backtracking steps per request (default: match_limit from config)") do |steps|
+          options[:match_limit] = steps
+        end
         parser.on("--host HOST", String, "Only find requests on this host") do |host|
           options[:host_filter] ||= []
           options[:host_filter] << host
         end
+        parser.on("--agent HOST:PORT", String, "Search through the ultragrep agent at HOST:PORT instead of local files") do |agent|
+          options[:agents] ||= []
+          options[:agents] << agent
+        end
       end
       parser.parse!(argv)
 
@@ -164,19 +121,44 @@ module Ultragrep
         options[:regexps] = argv
       end
 
-      options[:printer] = if options.delete(:perf)
-        RequestPerformancePrinter.new(options[:verbose])
-      else
-        RequestPrinter.new(options[:verbose])
+      if options[:estimate] && (options[:estimate] <= 0 || options[:tail] || options[:max_count])
+        $stderr.puts("--estimate needs a number of seconds above 0, and counts everything it reads: no --tail or --max-count")
+        exit 1
+      end
+      if options[:reverse] && options[:tail]
+        $stderr.puts("--reverse can't be used with --tail")
+        exit 1
+      end
+
+      if options[:match_limit] && options[:match_limit] <= 0
+        $stderr.puts("--match-limit needs a number of steps above 0")
+        exit 1
       end
 
       options[:config] = load_config(options[:config])
+      if !MATCH_LIMIT_POLICIES.include?(options[:config].fetch('match_limit_policy', 'skip'))
+        $stderr.puts("match_limit_policy is one of #{MATCH_LIMIT_POLICIES.join(', ')}")
+        exit 1
+      end
+      memory_limit = merge_memory_limit(options[:config])
+      options[:printer] = if options[:estimate]
+        EstimatePrinter.new(options[:verbose], memory_limit)
+      elsif options.delete(:perf)
+        RequestPerformancePrinter.new(options[:verbose], memory_limit)
+      else
+        RequestPrinter.new(options[:verbose], memory_limit)
+      end
+      options[:printer].reverse = options[:reverse]
+      options[:printer].abort_on_limit = abort_on_limit?(options[:config])
+      options[:agents] ||= options[:config]['agents']
 
       options
     end
 
     def ultragrep(options)
       lower_priority
+      return search_agents(options) if options[:agents]
+
       config = options.fetch(:config)
       file_type = options.fetch(:type, config.default_file_type)
       if !config.types[file_type]
@@ -184,7 +166,14 @@ module Ultragrep
         exit 1
       end
 
-      lua = config.types[file_type]["lua"]
+      begin
+        where_args(options)
+      rescue ArgumentError => e
+        $stderr.puts(e.message)
+        exit 1
+      end
+
+      lua = config.framer(file_type)
       collector = Ultragrep::LogCollector.new(config.log_path_glob(file_type), options)
       file_lists = collector.collect_files
       if !file_lists
@@ -192,84 +181,339 @@ module Ultragrep
         exit 1
       end
 
+      search_files(file_lists, lua, options)
+      report_limits(options)
+    end
+
+    def search_files(file_lists, lua, options)
+      config = options.fetch(:config)
       concurrency_limit = config.fetch('concurrency_limit', ifnone = file_lists.length)
       request_printer = options.fetch(:printer)
+      request_printer.max_count = options[:max_count]
       request_printer.run
 
       print_regex_info(options) if options[:verbose]
 
-      regexps =  options[:regexps].map { |r| "+" + r }
-      regexps += options[:not_regexps].map { |r| "!" + r } if options[:not_regexps]
-
+      regexps = query_regexps(options)
       quoted_regexps = quote_shell_words(regexps)
-      file_lists.each do |files|
+      # newest first, the last day's logs go first
+      scheduler = Scheduler.new(options[:reverse] ? file_lists.reverse : file_lists) do |files|
         print_search_list(files) if options[:verbose]
+        files.each { |file| request_printer.set_not_started(file) }
+      end
+      # tails never finish, every one of them needs a slot
+      concurrency_limit = scheduler.size if options[:tail]
+
+      # start as many slots as we may ever use; the throttle decides how many of them run
+      throttle = if (adaptive = config['adaptive_concurrency']) && !options[:tail]
+        adaptive = { 'max' => concurrency_limit }.merge(adaptive)
+        concurrency_limit = adaptive['max']
+        Throttle.new(file_lists.flatten, adaptive)
+      end
+
+      slots = [concurrency_limit, scheduler.size].min
+      options[:sample_rate] = sample_rate(file_lists.flatten, slots, options) if options[:estimate]
+      # --max-count: once the printer has everything it's going to print, what's
+      # still being searched can't make it into the output anymore
+      running = Array.new(slots)
+      request_printer.on_full { running.compact.each { |pipe| stop_worker(pipe) } }
+
+      # every slot picks up the next file as soon as it's done with the last one
+      slots.times.map do |slot|
+        Thread.new do
+          persistent = nil
+          loop do
+            throttle.acquire if throttle
+            begin
+              break if request_printer.full? || !(file = scheduler.next_file)
+
+              # the disk can be getting the next file while this one's matched
+              upcoming = scheduler.upcoming
+              upcoming = nil if upcoming =~ /^tail/
+              pipe = if config['persistent_workers'] && !needs_pipe?(file)
+                persistent ||= IO.popen("#{ug_guts} -w -l #{lua}", "r+", :pgroup => true)
+                send_job(persistent, file, regexps, options, upcoming)
+              else
+                worker(file, lua, quoted_regexps, options, upcoming)
+              end
 
-        files.each_slice(concurrency_limit) do |sliced_files|
-          children_pipes = sliced_files.map do |file|
-              [worker(file, lua, quoted_regexps, options), file]
+              running[slot] = pipe
+              read_worker(file, pipe, request_printer, options, file, true)
+              running[slot] = nil
+              if request_printer.full?
+                stop_worker(pipe)
+                persistent = nil if pipe == persistent
+              end
+              # closing a pipe waits for its child; an agent runs several searches at once.
+              pipe.close unless pipe == persistent
+            ensure
+              throttle.release if throttle
+            end
           end
 
-          children_pipes.each do |pipe, _|
-            request_printer.set_read_up_to(pipe, 0)
+          if persistent
+            persistent.close_write
+            persistent.close
           end
+        end
+      end.each(&:join)
+      throttle.stop if throttle
 
-          # each thread here waits for child data and then pushes it to the printer thread.
-          children_pipes.map do |pipe, filename|
-            worker_reader(filename, pipe, request_printer, options)
-          end.each(&:join)
+      request_printer.finish
+    end
 
-          Process.waitall
+    # fan the query out to the agents and merge their streams like local workers
+    def search_agents(options)
+      if (unsupported = [:tail, :estimate, :reverse].detect { |option| options[option] })
+        $stderr.puts("--#{unsupported} is not supported when searching through agents")
+        exit 1
+      end
+
+      request_printer = options.fetch(:printer)
+      request_printer.max_count = options[:max_count]
+      request_printer.run
+
+      print_regex_info(options) if options[:verbose]
+
+      query = Agent::QUERY_KEYS.each_with_object({}) do |key, q|
+        q[key] = options[key.to_sym] if options[key.to_sym]
+      end.to_json
+
+      sockets = options[:agents].map do |agent|
+        host, port = agent.split(":")
+        begin
+          socket = TCPSocket.new(host, Integer(port))
+        rescue SystemCallError, ArgumentError, SocketError => e
+          $stderr.puts("Couldn't connect to agent #{agent}: #{e.message}")
+          exit 1
         end
+        socket.puts(query)
+        request_printer.set_read_up_to(socket, 0)
+        socket
       end
 
+      sockets.map do |socket|
+        worker_reader(nil, socket, request_printer, options)
+      end.each(&:join)
+      sockets.each(&:close)
+
       request_printer.finish
+      report_limits(options)
+    end
+
+    # how much matched output the printer may hold before spilling to disk
+    def merge_memory_limit(config)
+      config['merge_memory_mb'] && config['merge_memory_mb'] * 1024 * 1024
+    end
+
+    # the regexps as ug_guts takes them: "+" for ones to match, "!" for ones not to
+    def query_regexps(options)
+      regexps = options[:regexps].map { |r| "+" + r }
+      regexps += options[:not_regexps].map { |r| "!" + r } if options[:not_regexps]
+      regexps
+    end
+
+    def abort_on_limit?(config)
+      config['match_limit_policy'] == 'abort'
+    end
+
+    # Set idle I/O and process priority, so other processes aren't starved for I/O
+    def lower_priority
+      system("ionice -c 3 -p #$$ >/dev/null 2>&1")
+      system("renice -n 19 -p #$$ >/dev/null 2>&1")
     end
 
     private
 
-    def worker(file, lua, quoted_regexps, options)
-      core = "#{ug_guts} -l #{lua} -s #{options[:range_start]} -e #{options[:range_end]} #{quoted_regexps}" #add -k an d-m here
+    def worker(file, lua, quoted_regexps, options, upcoming = nil)
+      core = "#{ug_guts} -u -l #{lua} -s #{options[:range_start]} -e #{options[:range_end]}"
+      core += " -P #{upcoming}" if upcoming
+      core += " -D" if drop_cache?(file, options)
+      core += " -S" if options[:stats]
+      core += " -m #{options[:max_count]}" if options[:max_count]
+      core += " -r #{options[:sample_rate]}" if options[:sample_rate]
+      core += " -R" if options[:reverse]
+      core += " -I" if index_on_read?(file, options)
+      core += match_limit_args(options).map { |arg| " #{arg}" }.join
+      core += " #{quote_shell_words(where_args(options))}" if options[:where]
+      core += " #{quote_shell_words(key_args(options))}" if options[:keys]
+      if file =~ /\.gz$/ && options.fetch(:config)['result_cache']
+        # archived logs don't change: let ug_guts read the file itself and remember what matched
+        return IO.popen("#{core} -f #{file} -c #{quoted_regexps}", :pgroup => true)
+      end
+
+      if threads = threads_per_file(file, options)
+        # ug_guts splits a big plain log up between its own threads
+        return IO.popen("#{core} -f #{file} -j #{threads} #{quoted_regexps}", :pgroup => true)
+      end
+
+      if (options[:where] || options[:sample_rate] || options[:reverse] || drop_cache?(file, options) ||
+          index_on_read?(file, options)) && !needs_pipe?(file)
+        # the log's .meta sidecar, if it has one, answers --where without reading the rest of it;
+        # only a ug_guts reading the log itself can keep it out of the page cache, sample or
+        # walk it backwards by its index, or write the index it doesn't have yet
+        return IO.popen("#{core} -f #{file} #{quoted_regexps}", :pgroup => true)
+      end
+
       command = if file =~ /\.bz2$/
         "bzip2 -dcf #{file}"
       elsif file =~ /^tail/
         "#{file}"
       else
-        "#{ug_cat} #{file} #{options[:range_start]}"
+        # with the framer, ug_cat can bisect a log that hasn't been indexed yet
+        "#{ug_cat} -l #{lua} #{file} #{options[:range_start]} #{options[:range_end]}"
       end
-      IO.popen("#{command} | #{core}")
+      IO.popen("#{command} | #{core} #{quoted_regexps}", :pgroup => true)
+    end
+
+    # bzip2 and tail output has to come in through a pipe
+    def needs_pipe?(file)
+      file =~ /\.bz2$/ || file =~ /^tail/
+    end
+
+    # only plain logs can be read from several places at once
+    def threads_per_file(file, options)
+      threads = options.fetch(:config)['threads_per_file'].to_i
+      threads if threads > 1 && !needs_pipe?(file) && file !~ /\.gz$/
+    end
+
+    # --estimate: the share of each log to count matches in, so that all of them
+    # together take about as long to read as the seconds given
+    def sample_rate(files, slots, options)
+      mb_per_sec = options.fetch(:config).fetch('scan_mb_per_sec', DEFAULT_SCAN_MB_PER_SEC)
+      bytes = files.map { |file| (File.size?(file) || 0) * (file =~ /\.(gz|bz2)$/ ? COMPRESSION_RATIO : 1) }.inject(0, :+)
+      readable = options[:estimate] * mb_per_sec * 1024 * 1024 * slots
+      bytes > readable ? readable / bytes : 1
+    end
+
+    # --where tests, and the type's meta_fields (name => regexp) for ug_guts to find the values with
+    def where_args(options)
+      return [] unless options[:where]
+      config = options.fetch(:config)
+      fields = config.types.fetch(options[:type] || config.default_file_type)['meta_fields'] || {}
+      options[:where].each do |test|
+        name = test[/\A[^=!<>]+/]
+        raise ArgumentError, "--where #{test}: no meta_fields entry named #{name.inspect}" unless fields[name]
+      end
+      fields.flat_map { |name, regexp| ["-F", "#{name}=#{regexp}"] } + options[:where].flat_map { |test| ["-W", test] }
+    end
+
+    def key_args(options)
+      (options[:keys] || []).flat_map { |test| ["-k", test] }
+    end
+
+    # logs nobody has written to in drop_cache_days are read without keeping them in the page cache
+    def drop_cache?(file, options)
+      days = options.fetch(:config)['drop_cache_days']
+      return false if !days || needs_pipe?(file)
+      mtime = File.mtime(file) rescue nil
+      !!mtime && mtime < Time.now - days * DAY
+    end
+
+    # a log ultragrep_build_indexes hasn't got to yet is indexed by the first search through it
+    def index_on_read?(file, options)
+      options.fetch(:config)['index_on_read'] && !needs_pipe?(file) &&
+        !File.exist?(File.dirname(file) + "/.#{File.basename(file)}.idx")
+    end
+
+    # how far one regexp may backtrack on one request, and whether running out stops the search
+    def match_limit_args(options)
+      limit = options[:match_limit] || options.fetch(:config)['match_limit']
+      args = limit ? ["-L", limit.to_i] : []
+      args << "-A" if abort_on_limit?(options.fetch(:config))
+      args
+    end
+
+    # the requests left out because a regexp ran out of backtracking on them;
+    # with match_limit_policy: abort, the search stopped at the first one
+    def report_limits(options)
+      regexps = query_regexps(options)
+      request_printer = options.fetch(:printer)
+      request_printer.limited.each do |i, count|
+        regexp = regexps[i] ? regexps[i][1..-1] : "regexp #{i}"
+        if request_printer.aborted?
+          $stderr.puts("Stopped: #{regexp.inspect} ran into the match limit (match_limit_policy: abort)")
+        else
+          $stderr.puts("#{count} request#{'s' if count != 1} left out: #{regexp.inspect} ran into the match limit on them")
+        end
+      end
+      exit 1 if request_printer.aborted?
+    end
+
+    # workers run in their own process group, so this gets ug_cat and bzip2 too
+    def stop_worker(pipe)
+      Process.kill("TERM", -pipe.pid)
+    rescue Errno::ESRCH
+    end
+
+    # a persistent ug_guts takes one search per line: its arguments, tab separated
+    def send_job(pipe, file, regexps, options, upcoming = nil)
+      args = ["-u", "-f", file, "-s", options[:range_start], "-e", options[:range_end]]
+      args += ["-P", upcoming] if upcoming
+      args << "-D" if drop_cache?(file, options)
+      args << "-c" if file =~ /\.gz$/ && options.fetch(:config)['result_cache']
+      args << "-S" if options[:stats]
+      args += ["-m", options[:max_count]] if options[:max_count]
+      args += ["-r", options[:sample_rate]] if options[:sample_rate]
+      args << "-R" if options[:reverse]
+      args << "-I" if index_on_read?(file, options)
+      args += match_limit_args(options)
+      threads = threads_per_file(file, options)
+      args += ["-j", threads] if threads
+      args += key_args(options)
+      args += where_args(options).map { |r| r.gsub("\t", "\\t").gsub("\n", "\\n") }
+      args += regexps.map { |r| r.gsub("\t", "\\t").gsub("\n", "\\n") }
+      pipe.puts(args.join("\t"))
+      pipe.flush
+      pipe
     end
 
     def worker_reader(filename, pipe, request_printer, options)
-      Thread.new do
-        parsed_up_to = nil
-        this_request = nil
-        while line = pipe.gets
+      Thread.new { read_worker(filename, pipe, request_printer, options) }
+    end
+
+    # reads one child's output and pushes it to the printer thread.
+    # ug_guts -u output is valid UTF-8 already, only agents' needs checking.
+    def read_worker(filename, pipe, request_printer, options, key = pipe, valid_utf8 = false)
+      parsed_up_to = nil
+      this_request = nil
+      while line = pipe.gets
+        break if line == "@@done\n" || request_printer.full?
+        if valid_utf8
+          line.force_encoding(Encoding::UTF_8)
+        else
           encode_utf8!(line)
-          if line =~ /^@@(\d+)/
-            # timestamp coming back from the child.
-            parsed_up_to = $1.to_i
-
-            request_printer.set_read_up_to(pipe, parsed_up_to)
-            this_request = [parsed_up_to, ["\n# #{filename}\n"]]
-          elsif line =~ /^---/
-            # end of request
-            this_request[1] << line if this_request
-            if options[:tail]
-              if this_request
-                STDOUT.write(request_printer.format_request(*this_request))
-                STDOUT.flush
-              end
-            else
-              request_printer.add_request(*this_request) if this_request
+        end
+        if line =~ /^@@(\d+)/
+          # timestamp coming back from the child.
+          parsed_up_to = $1.to_i
+
+          request_printer.set_read_up_to(key, parsed_up_to)
+          # agents send requests that already carry their file name
+          this_request = [parsed_up_to, filename ? ["\n# #{filename}\n"] : []]
+        elsif line =~ /^@@sample (\d+) (\d+) (\d+) (\d+)/
+          request_printer.add_sample($1.to_i, $2.to_i, $3.to_i, $4.to_i)
+        elsif line =~ /^@@limited (\d+) (\d+)/
+          request_printer.add_limited($1.to_i, $2.to_i)
+        elsif line =~ /^@@error (.*)/
+          $stderr.puts("ultragrep agent: #{$1}")
+        elsif line =~ /^---/
+          # end of request
+          this_request[1] << line if this_request
+          if options[:tail]
+            if this_request
+              STDOUT.write(request_printer.format_request(*this_request))
+              STDOUT.flush
             end
-            this_request = [parsed_up_to, [line]]
           else
-            this_request[1] << line if this_request
+            request_printer.add_request(*this_request) if this_request
           end
+          this_request = [parsed_up_to, [line]]
+        else
+          this_request[1] << line if this_request
         end
-        request_printer.set_done(pipe)
       end
+      request_printer.set_done(key)
     end
 
     def print_regex_info(options)
@@ -304,12 +548,6 @@ module Ultragrep
       words.map { |r| "'" + r.gsub("'", ".") + "'" }.join(' ')
     end
 
-    # Set idle I/O and process priority, so other processes aren't starved for I/O
-    def lower_priority
-      system("ionice -c 3 -p #$$ >/dev/null 2>&1")
-      system("renice -n 19 -p #$$ >/dev/null 2>&1")
-    end
-
     def parse_time(string)
       if string =~ /^\d+$/ && string !~ /^20/
         string.to_i
@@ -0,0 +1,117 @@
+require 'json'
+require 'socket'
+
+module Ultragrep
+  # An agent runs on a storage node, next to the logs.  It takes one query per
+  # connection (a single line of JSON), searches its own files with the usual
+  # ug_cat | ug_guts pipelines and streams the matches back in time order:
+  #
+  #   @@<timestamp>         -- a request follows, or just a watermark
+  #   <request lines>
+  #   ------                -- end of request
+  #   @@limited <n> <count> -- regexp n ran out of backtracking on count requests
+  #
+  # which is what ug_guts itself prints, so the driver can merge agents the
+  # same way it merges local workers.
+  class Agent
+    QUERY_KEYS = %w(range_start range_end regexps not_regexps type host_filter max_count where keys match_limit)
+
+    def initialize(config, port, bind = "0.0.0.0")
+      @config, @port, @bind = config, port, bind
+    end
+
+    def run
+      Ultragrep.lower_priority
+      server = TCPServer.new(@bind, @port)
+      loop do
+        Thread.new(server.accept) { |socket| serve(socket) }
+      end
+    end
+
+    def serve(socket)
+      options = parse_query(socket.gets, socket)
+      file_type = options.fetch(:type, @config.default_file_type)
+      if !@config.types[file_type]
+        socket.puts("@@error no such log type: #{file_type}")
+        return
+      end
+
+      collector = Ultragrep::LogCollector.new(@config.log_path_glob(file_type), options)
+      file_lists = collector.collect_files || []
+      Ultragrep.search_files(file_lists, @config.framer(file_type), options)
+    rescue JSON::ParserError, KeyError, ArgumentError, TypeError => e
+      socket.puts("@@error bad query: #{e.message}") rescue nil
+    rescue StandardError => e
+      # one connection's failure is no reason to take the agent down with it
+      socket.puts("@@error #{e.class}: #{e.message}") rescue nil
+    ensure
+      socket.close
+    end
+
+    private
+
+    def parse_query(line, socket)
+      query = JSON.parse(line.to_s)
+      raise ArgumentError, "not a JSON object" unless query.is_a?(Hash)
+      options = {}
+      QUERY_KEYS.each { |k| options[k.to_sym] = query[k] if query[k] }
+      raise ArgumentError, "regexps must be a non-empty list of strings" unless string_list?(query["regexps"]) && query["regexps"].any?
+      raise ArgumentError, "not_regexps must be a list of strings" unless query["not_regexps"].nil? || string_list?(query["not_regexps"])
+      # these end up on ug_guts' command line
+      %w(where keys host_filter).each do |key|
+        raise ArgumentError, "#{key} must be a list of strings" unless query[key].nil? || string_list?(query[key])
+      end
+      raise ArgumentError, "type must be a string" unless query["type"].nil? || query["type"].is_a?(String)
+      %w(max_count match_limit).each do |key|
+        next unless query[key]
+        options[key.to_sym] = Integer(query[key])
+        raise ArgumentError, "#{key} must be above 0" if options[key.to_sym] <= 0
+      end
+      options[:range_start] = Integer(query.fetch("range_start"))
+      options[:range_end] = Integer(query.fetch("range_end"))
+      options[:config] = @config
+      options[:printer] = AgentPrinter.new(socket, Ultragrep.merge_memory_limit(@config))
+      options[:printer].abort_on_limit = @config['match_limit_policy'] == 'abort'
+      options
+    end
+
+    def string_list?(value)
+      value.is_a?(Array) && value.all? { |v| v.is_a?(String) }
+    end
+  end
+
+  # Sends requests (and the timestamp everything has been searched up to)
+  # down the agent's socket instead of printing them.
+  class AgentPrinter < RequestPrinter
+    def initialize(socket, memory_limit = nil)
+      super(false, memory_limit)
+      @socket = socket
+    end
+
+    def dump_buffer
+      to_this_ts = @mutex.synchronize { @children_timestamps.values.min || 0 }
+
+      out = ""
+      each_ready(to_this_ts) do |ts, text|
+        out << "@@#{ts}\n#{text}"
+        if out.bytesize > 65536
+          @socket.write(out)
+          out = ""
+        end
+      end
+      out << "@@#{to_this_ts}\n" if to_this_ts > 0
+      @socket.write(out)
+      @socket.flush
+    rescue IOError, SystemCallError
+      # the driver went away, nothing to do but finish the search
+    end
+
+    # what the agent's workers left out goes on to the driver, which warns about it
+    def finish
+      super
+      @limited.each { |regexp, count| @socket.puts("@@limited #{regexp} #{count}") }
+      @socket.flush
+    rescue IOError, SystemCallError
+    end
+  end
+end
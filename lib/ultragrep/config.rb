@@ -46,6 +46,14 @@ module Ultragrep
       @data["types"]
     end
 
+    # what frames the type's logs: its lua file, or for "format: json" the
+    # built-in JSON-lines framer, timed by the record's time_field (default "time")
+    def framer(type)
+      settings = types.fetch(type)
+      return settings['lua'] if settings['lua'] || settings['format'] != 'json'
+      "json:#{settings.fetch('time_field', 'time')}"
+    end
+
     def available_types
       types.keys
     end
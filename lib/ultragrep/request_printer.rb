@@ -0,0 +1,259 @@
+require 'tempfile'
+
+module Ultragrep
+  class RequestPrinter
+    # how much matched output to hold in memory (in bytes) while waiting for the
+    # slowest file to catch up, before spilling it to disk
+    DEFAULT_MEMORY_LIMIT = 256 * 1024 * 1024
+
+    # print only the first this many requests (in the order they print in), nil for all of them
+    attr_accessor :max_count
+
+    # newest first: the workers' timestamps go down, and we print down to the highest of them
+    attr_accessor :reverse
+
+    # stop everything at the first request a regexp runs out of backtracking on
+    attr_accessor :abort_on_limit
+
+    # how many requests each regexp (by its place in the query) ran out on
+    attr_reader :limited
+
+    def initialize(verbose, memory_limit = nil)
+      @mutex = Mutex.new
+      @wake = ConditionVariable.new
+      @all_data = []
+      @buffered_bytes = 0
+      @memory_limit = memory_limit || DEFAULT_MEMORY_LIMIT
+      @runs = []
+      @children_timestamps = {}
+      @finish = false
+      @printed = 0
+      @verbose = verbose
+      @limited = Hash.new(0)
+      @aborted = false
+    end
+
+    def dump_buffer
+      to_this_ts = nil
+
+      @mutex.synchronize do
+        if @reverse
+          to_this_ts = @children_timestamps.values.max || 2**50
+          $stderr.puts("I've searched back to #{Time.at(to_this_ts)}") if @verbose && to_this_ts > 0 && to_this_ts != 2**50
+        else
+          to_this_ts = @children_timestamps.values.min || 0 # FIXME : should not be necessary, but fails with -t -p
+          $stderr.puts("I've searched up through #{Time.at(to_this_ts)}") if @verbose && to_this_ts > 0 && to_this_ts != 2**50
+        end
+      end
+
+      each_ready(to_this_ts) { |_, text| STDOUT.write(text) }
+      STDOUT.flush
+    end
+
+    def run
+      @thread = Thread.new do
+        loop do
+          finishing = @mutex.synchronize do
+            @wake.wait(@mutex, 2) unless @finish
+            @finish
+          end
+          dump_buffer
+          break if finishing
+        end
+      end
+    end
+
+    def add_request(parsed_up_to, text)
+      return if full?
+      @mutex.synchronize do
+        if text = format_request(parsed_up_to, text)
+          @all_data << [parsed_up_to, text]
+          @buffered_bytes += text.bytesize
+          spill if @buffered_bytes > @memory_limit
+        end
+      end
+    end
+
+    def format_request(parsed_up_to, text)
+      text.join
+    end
+
+    # what a ug_guts -r counted in one log (see EstimatePrinter)
+    def add_sample(blocks, sampled, sum, sumsq)
+    end
+
+    # what a ug_guts -L left out
+    def add_limited(regexp, count)
+      @mutex.synchronize { @limited[regexp] += count }
+      @aborted = true if @abort_on_limit
+    end
+
+    def aborted?
+      @aborted
+    end
+
+    def set_read_up_to(key, val)
+      @mutex.synchronize { @children_timestamps[key] = val }
+    end
+
+    # a file that hasn't started yet may still have anything after (or newest first, before) the others
+    def set_not_started(key)
+      set_read_up_to(key, @reverse ? 2**50 : 0)
+    end
+
+    def set_done(key)
+      @mutex.synchronize { @children_timestamps[key] = @reverse ? 0 : 2**50 }
+    end
+
+    # the printer thread does the last dump: the spilled runs can't be read from two threads
+    def finish
+      @mutex.synchronize do
+        @finish = true
+        @wake.signal
+      end
+      @thread ? @thread.join : dump_buffer
+    end
+
+    # whether everything that's going to be printed has been -- workers can stop
+    def full?
+      @aborted || (@max_count && @printed >= @max_count)
+    end
+
+    # called once, from the printer thread, when the printer gets full
+    def on_full(&block)
+      @on_full = block
+    end
+
+    private
+
+    # yields the requests up to to_this_ts in time order, merging what's in
+    # memory with the runs spilled to disk
+    def each_ready(to_this_ts)
+      ready = runs = nil
+      @mutex.synchronize do
+        ready, @all_data = @all_data.partition { |req| ready?(req[0], to_this_ts) }
+        @buffered_bytes -= ready.inject(0) { |sum, req| sum + req[1].bytesize }
+        runs = @runs.dup
+      end
+
+      sources = runs + [BufferedRun.new(in_order(ready))]
+      while !full? && source = sources.select { |s| s.peek && ready?(s.peek[0], to_this_ts) }.send(@reverse ? :max_by : :min_by, &:peek)
+        yield source.shift
+        @printed += 1
+      end
+      if full? && @on_full
+        @on_full.call
+        @on_full = nil
+      end
+
+      @mutex.synchronize { @runs -= runs.select(&:empty?) }
+    end
+
+    def ready?(ts, to_this_ts)
+      @reverse ? ts >= to_this_ts : ts <= to_this_ts
+    end
+
+    def in_order(requests)
+      @reverse ? requests.sort.reverse : requests.sort
+    end
+
+    # called with the mutex held, so workers wait while we write -- they can't
+    # get further ahead than the disk lets us
+    def spill
+      @runs << SpilledRun.new(in_order(@all_data))
+      @all_data = []
+      @buffered_bytes = 0
+    end
+
+    class BufferedRun
+      def initialize(requests)
+        @requests = requests
+        @next = 0
+      end
+
+      def peek
+        @requests[@next]
+      end
+
+      def shift
+        @next += 1
+        @requests[@next - 1]
+      end
+
+      def empty?
+        @next >= @requests.size
+      end
+    end
+
+    # sorted requests in an unlinked temp file, read back one at a time
+    class SpilledRun
+      attr_reader :peek
+
+      def initialize(requests)
+        @file = Tempfile.new("ultragrep-merge")
+        @file.unlink
+        requests.each { |req| Marshal.dump(req, @file) }
+        @file.rewind
+        shift
+      end
+
+      def shift
+        current = @peek
+        if @file.eof?
+          @file.close
+          @peek = nil
+        else
+          @peek = Marshal.load(@file)
+        end
+        current
+      end
+
+      def empty?
+        @peek.nil?
+      end
+    end
+  end
+
+  # --estimate: no requests, just how many there are about to be. each log is
+  # sampled on its own, a stratum: of its index blocks in range, a share is
+  # counted, and the total and its variance are the sum of what each log's
+  # sample says about the whole log.
+  class EstimatePrinter < RequestPrinter
+    def initialize(*)
+      super
+      @blocks = @sampled = @counted = 0
+      @total = @variance = 0.0
+    end
+
+    def add_sample(blocks, sampled, sum, sumsq)
+      return if sampled == 0
+      mean = sum.to_f / sampled
+      spread = sampled > 1 ? (sumsq - sampled * mean**2) / (sampled - 1) : 0
+      @mutex.synchronize do
+        @blocks += blocks
+        @sampled += sampled
+        @counted += sum
+        @total += blocks * mean
+        @variance += blocks**2 * (1 - sampled.to_f / blocks) * spread / sampled
+      end
+    end
+
+    def finish
+      super
+      margin = 1.96 * Math.sqrt(@variance)
+      low = [@total - margin, @counted].max
+      puts("about #{@total.round} matching requests (95% confidence: #{low.round} - #{(@total + margin).round}), " \
+        "counted in #{@sampled} of #{@blocks} index blocks")
+    end
+  end
+
+  class RequestPerformancePrinter < RequestPrinter
+    def format_request(parsed_up_to, req)
+      text = req.join
+      return unless text =~ /.*Processing ([^ ]+) .*Completed in (\d+)ms/m
+      action = $1
+      time = $2
+      "#{parsed_up_to}\t#{action}\t#{time}\n"
+    end
+  end
+end
@@ -0,0 +1,43 @@
+module Ultragrep
+  # Hands out the files to search one at a time, to however many workers ask.
+  # Within a day the biggest files go first, so one large host file doesn't end
+  # up starting last; a day's last files run alongside the next day's first.
+  #
+  # The printer only prints up to the lowest timestamp any file has reached, so
+  # before the first file of a day is handed out, the block is called with all
+  # of that day's files to register them -- a file that hasn't started yet
+  # holds back everything after the start of its day.
+  class Scheduler
+    def initialize(file_lists, &on_start_of_group)
+      @file_lists = file_lists.map { |files| files.sort_by { |f| -(File.size?(f) || 0) } }
+      @on_start_of_group = on_start_of_group
+      @mutex = Mutex.new
+      @queue = []
+      @group = -1
+    end
+
+    def size
+      @file_lists.map(&:size).inject(0, :+)
+    end
+
+    # the next file to search, or nil when there's nothing left
+    def next_file
+      @mutex.synchronize do
+        while @queue.empty?
+          @group += 1
+          return nil if @group >= @file_lists.size
+          @queue = @file_lists[@group].dup
+          @on_start_of_group.call(@queue) if @on_start_of_group
+        end
+        @queue.shift
+      end
+    end
+
+    # what next_file will most likely hand out next, for workers to read ahead
+    def upcoming
+      @mutex.synchronize do
+        @queue.first || @file_lists[(@group + 1)..-1].to_a.flatten.first
+      end
+    end
+  end
+end
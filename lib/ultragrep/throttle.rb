@@ -0,0 +1,99 @@
+module Ultragrep
+  # Decides how many files are searched at once. Without adaptive_concurrency
+  # that's concurrency_limit, fixed; with it, the number starts at min and moves
+  # between min and max as the query runs: up while the disks holding the logs
+  # are less busy than the target and there's CPU to spare, down as soon as
+  # they're busier. A query over cached or compressed logs ends up at max, one
+  # over cold logs on spinning disks at what they can take without thrashing
+  # (and without starving whoever else is using them).
+  class Throttle
+    INTERVAL = 2
+    DEFAULT_UTILIZATION = 0.8
+
+    attr_reader :limit
+
+    def initialize(files, settings)
+      @min = [settings.fetch('min', 1).to_i, 1].max
+      @max = [settings.fetch('max', @min).to_i, @min].max
+      @target = settings.fetch('disk_utilization', DEFAULT_UTILIZATION).to_f
+      @limit = @min
+      @active = 0
+      @mutex = Mutex.new
+      @cond = ConditionVariable.new
+      @devices = devices_for(files)
+      @sampler = Thread.new { sample_loop }
+    end
+
+    # wait for a free slot
+    def acquire
+      @mutex.synchronize do
+        @cond.wait(@mutex) while @active >= @limit
+        @active += 1
+      end
+    end
+
+    def release
+      @mutex.synchronize do
+        @active -= 1
+        @cond.broadcast
+      end
+    end
+
+    def stop
+      @sampler.kill
+    end
+
+    # adjust the limit to how busy the disks (0..1) and CPUs (0..1 idle) were over the last interval
+    def adjust(utilization, cpu_idle)
+      @mutex.synchronize do
+        if utilization > @target
+          @limit = [@limit - 1, @min].max
+        elsif utilization < @target * 0.8 && cpu_idle > 0.1 && @active >= @limit
+          @limit = [@limit + 1, @max].min
+          @cond.broadcast
+        end
+      end
+    end
+
+    private
+
+    def sample_loop
+      ticks, cpu = io_ticks, cpu_times
+      loop do
+        sleep INTERVAL
+        new_ticks, new_cpu = io_ticks, cpu_times
+        busy = new_ticks.map { |dev, t| (t - ticks.fetch(dev, t)) / (INTERVAL * 1000.0) }.max || 0
+        total = new_cpu.sum - cpu.sum
+        idle = total > 0 ? (new_cpu[3] - cpu[3]).to_f / total : 1
+        adjust(busy, idle)
+        ticks, cpu = new_ticks, new_cpu
+      end
+    end
+
+    # "major:minor" of the block devices the files live on
+    def devices_for(files)
+      files.map do |file|
+        stat = File.stat(file) rescue next
+        "#{stat.dev_major}:#{stat.dev_minor}"
+      end.compact.uniq
+    end
+
+    # milliseconds each device has spent doing I/O, from /proc/diskstats
+    def io_ticks
+      File.readlines("/proc/diskstats").each_with_object({}) do |line, ticks|
+        fields = line.split
+        dev = "#{fields[0]}:#{fields[1]}"
+        ticks[dev] = fields[12].to_i if @devices.include?(dev)
+      end
+    rescue SystemCallError
+      {}
+    end
+
+    # user nice system idle ... jiffies, from /proc/stat
+    def cpu_times
+      File.readlines("/proc/stat").first.split[1..-1].map(&:to_i)
+    rescue SystemCallError
+      [0, 0, 0, 0]
+    end
+  end
+end
@@ -1,31 +1,36 @@
-request = { ['offset'] = 0, ['data'] = {} }
+request = { ['offset'] = 0, ['length'] = 0 }
 strptime_format = "%Y-%m-%d %H:%M:%S"
 blanks = 0
 
+-- we only keep track of where a request starts and ends; the C side holds on
+-- to the bytes and hands them to the matcher without a round trip through lua.
 function process_line(line, offset)
   if line == "\n" then
     blanks = blanks + 1
   else
-    if blanks >= 2 and request['data'] then
-      -- insert the last request, reset
-      request['data'] = table.concat(request['data'])
-      ug_request.add(request['data'], request['ts'], request['offset'])
+    if blanks >= 2 then
+      -- report the last request, reset
+      if request['length'] > 0 then
+        ug_request.add_extent(request['offset'], request['length'], request['ts'])
+      end
 
-      request = { ['offset'] = offset, ['data'] = {} }
-      blanks = 0 
+      request = { ['offset'] = offset, ['length'] = 0 }
+      blanks = 0
     end
 
     if not request['ts'] then
       _, _, ts = string.find(line, "at (%d%d%d%d%-%d%d%-%d%d %d%d:%d%d:%d%d)")
-      if ts then 
-        request['ts'] =  ts 
+      if ts then
+        request['ts'] =  ts
       end
     end
-    table.insert(request['data'], line)
+    -- a request runs up to the end of its last non-blank line
+    request['length'] = offset + #line - request['offset']
   end
 end
 
 function on_eof()
-  request['data'] = table.concat(request['data'])
-  ug_request.add(request['data'], request['ts'], request['offset'])
+  if request['length'] > 0 then
+    ug_request.add_extent(request['offset'], request['length'], request['ts'])
+  end
 end
@@ -322,6 +322,319 @@ Processing -10 at 2012-01-01 01:00:00\n\n
         end
       end
 
+      context "several plain-text regexps" do
+        it "needs all of them to match" do
+          date = date()
+          write "foo/host.1/a.log-#{date}", "Processing xxx/yyy.json at #{time}\n\n\nProcessing xxx/zzz.json at #{time}\n\n\nProcessing xxx/yyyjson at #{time}\n\n\n"
+          output = ultragrep("xxx 'yyy\\.json' --not zzz")
+          output.should include "xxx/yyy.json"
+          output.should_not include "xxx/zzz"
+          output.should_not include "xxx/yyyjson"
+        end
+      end
+
+      context "invalid UTF-8" do
+        it "leaves the invalid bytes out" do
+          date = date()
+          File.open("foo/host.1/a.log-#{date}", "wb") { |f| f.write("Processing xxx \xE2\x82\xAC\xA0\xC0\xAFok at #{time}\n".b) }
+          ultragrep("xxx").should include "Processing xxx \u20ACok at #{time}\n"
+        end
+      end
+
+      context "multi-line requests" do
+        it "prints the request as it is in the log" do
+          date = date()
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n  Parameters: {}\n\nCompleted in 7ms\n\n\nProcessing yyy at #{time}\n"
+          output = ultragrep("xxx")
+          output.should include "Processing xxx at #{time}\n  Parameters: {}\n\nCompleted in 7ms\n---------------\n"
+          output.should_not include "yyy"
+        end
+      end
+
+      context "with fewer workers than files" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("concurrency_limit" => 2).to_yaml)
+          write "foo/host.1/a.log-#{date(1)}", (1..50).map { |i| "Processing xxx #{i} at #{time_at(day + 100 - i)}\n\n\n" }.join
+          write "foo/host.2/a.log-#{date(1)}", "Processing xxx 0 at #{time_at(day + 200)}\n"
+          write "foo/host.3/a.log-#{date(1)}", "Processing xxx 99 at #{time_at(day)}\n"
+          write "foo/host.1/a.log-#{date}", "Processing xxx 100 at #{time_at(10)}\n"
+          write "foo/host.2/a.log-#{date}", "Processing xxx 101 at #{time_at(5)}\n"
+        end
+
+        it "searches every file and keeps the output in time order" do
+          output = ultragrep("xxx --daysback 2")
+          output.scan(/xxx (\d+)/).flatten.map(&:to_i).should == [0, *(1..50), 99, 100, 101]
+        end
+
+        it "merges through temp files when matches don't fit in memory" do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("merge_memory_mb" => 0.0001).to_yaml)
+          output = ultragrep("xxx --daysback 2")
+          output.scan(/xxx (\d+)/).flatten.map(&:to_i).should == [0, *(1..50), 99, 100, 101]
+        end
+      end
+
+      context "result_cache" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("result_cache" => true).to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing xxx/yyy at #{time}\n\n\nProcessing zzz at #{time}\n"
+          run "gzip foo/host.1/a.log-#{date}"
+        end
+
+        it "remembers which requests matched in gzipped logs" do
+          first = ultragrep("xxx")
+          File.exist?("foo/host.1/.a.log-#{date}.gz.ugcache").should be true
+          ultragrep("xxx").should == first
+          first.scan(/Processing \S+/).should == ["Processing xxx", "Processing xxx/yyy"]
+        end
+
+        it "answers narrower searches from a cached one" do
+          ultragrep("xxx")
+          ultragrep("xxx yyy").scan(/Processing \S+/).should == ["Processing xxx/yyy"]
+          ultragrep("xxx --not yyy").scan(/Processing \S+/).should == ["Processing xxx"]
+        end
+      end
+
+      context "--stats" do
+        before do
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing yyy at #{time}\n"
+        end
+
+        it "reports what each regexp rejected" do
+          output = ultragrep("xxx --not zzz --stats")
+          output.should include "2 requests checked"
+          output.should =~ /\+xxx +2 tested +1 rejected/
+          output.should include "Processing xxx at #{time}"
+        end
+
+        it "does not report without" do
+          ultragrep("xxx").should_not include "requests checked"
+        end
+      end
+
+      context "--max-count" do
+        before do
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time_at(40)}\n\n\nProcessing xxx/3 at #{time_at(20)}\n\n\nProcessing xxx/5 at #{time_at(0)}\n"
+          write "foo/host.2/a.log-#{date}", "Processing xxx/2 at #{time_at(30)}\n\n\nProcessing xxx/4 at #{time_at(10)}\n"
+        end
+
+        it "prints the first matches in time" do
+          ultragrep("xxx -m 3").scan(/Processing \S+/).should == ["Processing xxx/1", "Processing xxx/2", "Processing xxx/3"]
+        end
+
+        it "stops persistent workers too" do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("persistent_workers" => true).to_yaml)
+          ultragrep("xxx --max-count 2").scan(/Processing \S+/).should == ["Processing xxx/1", "Processing xxx/2"]
+        end
+      end
+
+      context "--reverse" do
+        before do
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time_at(40)}\n\n\nProcessing xxx/3 at #{time_at(20)}\n\n\nProcessing xxx/5 at #{time_at(0)}\n"
+          write "foo/host.2/a.log-#{date}", "Processing xxx/2 at #{time_at(30)}\n\n\nProcessing xxx/4 at #{time_at(10)}\n"
+        end
+
+        it "prints the newest matches first" do
+          ultragrep("xxx -r").scan(/Processing \S+/).should == (1..5).map { |i| "Processing xxx/#{i}" }.reverse
+        end
+
+        it "stops after the last ones with --max-count, indexed or not" do
+          run "#{Bundler.root}/bin/ultragrep_build_indexes -t app"
+          File.unlink("foo/host.2/.a.log-#{date}.idx")
+          ultragrep("xxx --reverse -m 2").scan(/Processing \S+/).should == ["Processing xxx/5", "Processing xxx/4"]
+        end
+      end
+
+      context "persistent_workers" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("persistent_workers" => true, "concurrency_limit" => 1).to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing yyy at #{time}\n"
+          write "foo/host.2/a.log-#{date}", "Processing xxx/zzz at #{time}\n"
+        end
+
+        it "runs searches through long-lived workers" do
+          ultragrep("xxx").scan(/Processing \S+/).sort.should == ["Processing xxx", "Processing xxx/zzz"]
+        end
+
+        it "passes inverted regexps along" do
+          ultragrep("xxx --not zzz").scan(/Processing \S+/).should == ["Processing xxx"]
+        end
+      end
+
+      context "threads_per_file" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("threads_per_file" => 3).to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing yyy at #{time}\n\n\nProcessing xxx/zzz at #{time}\n"
+          write "foo/host.2/a.log-#{date}", "Processing xxx/2 at #{time}\n"
+        end
+
+        it "finds the same requests" do
+          ultragrep("xxx").scan(/Processing \S+/).sort.should == ["Processing xxx", "Processing xxx/2", "Processing xxx/zzz"]
+        end
+
+        it "gives a request without a time right after a cut the time before it" do
+          dump = "  #{"x" * 99}\n" * 200_000
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time}\n#{dump}\n\n\nProcessing untimed\n  needle\n\n\nProcessing xxx/2 at #{time}\n#{dump}"
+          ultragrep("needle").should include "Processing untimed"
+        end
+      end
+
+      context "drop_cache_days" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("drop_cache_days" => 0).to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing yyy at #{time}\n"
+        end
+
+        it "finds the same requests reading around the page cache" do
+          ultragrep("xxx").scan(/Processing \S+/).should == ["Processing xxx"]
+        end
+      end
+
+      context "index_on_read" do
+        before do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("index_on_read" => true).to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx at #{time}\n\n\nProcessing yyy at #{time}\n"
+        end
+
+        it "writes the index of a plain log as it searches it" do
+          ultragrep("xxx").scan(/Processing \S+/).should == ["Processing xxx"]
+          File.exist?("foo/host.1/.a.log-#{date}.idx").should be true
+          ultragrep("yyy").scan(/Processing \S+/).should == ["Processing yyy"]
+        end
+
+        it "writes both indexes of a gzipped log" do
+          run "gzip foo/host.1/a.log-#{date}"
+          ultragrep("xxx").scan(/Processing \S+/).should == ["Processing xxx"]
+          File.exist?("foo/host.1/.a.log-#{date}.gz.idx").should be true
+          File.exist?("foo/host.1/.a.log-#{date}.gz.gzidx").should be true
+          Dir.glob("foo/host.1/.*.[0-9]*").should == []
+        end
+      end
+
+      context "--where" do
+        before do
+          config = YAML.load_file(".ultragrep.yml")
+          config["types"]["app"]["meta_fields"] = { "status" => 'Completed (\d+)', "duration" => 'in (\d+)ms' }
+          File.write(".ultragrep.yml", config.to_yaml)
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time}\nCompleted 200 in 12ms\n\n\n" +
+            "Processing xxx/2 at #{time}\nCompleted 500 in 3000ms\n\n\nProcessing xxx/3 at #{time}\nCompleted 500 in 40ms\n"
+        end
+
+        it "answers from the .meta sidecar" do
+          run "#{Bundler.root}/bin/ultragrep_build_indexes -t app"
+          File.exist?("foo/host.1/.a.log-#{date}.meta").should be true
+          ultragrep("xxx --where status=500").scan(/Processing \S+/).should == ["Processing xxx/2", "Processing xxx/3"]
+          ultragrep("xxx --where status=500 --where 'duration>2000'").scan(/Processing \S+/).should == ["Processing xxx/2"]
+        end
+
+        it "tests the request text without one" do
+          ultragrep("xxx --where 'duration<100'").scan(/Processing \S+/).should == ["Processing xxx/1", "Processing xxx/3"]
+        end
+
+        it "refuses fields that aren't configured" do
+          ultragrep("xxx --where nope=1", :fail => true).should include "nope"
+        end
+      end
+
+      context "json logs" do
+        before do
+          config = YAML.load_file(".ultragrep.yml")
+          config["types"]["json"] = { "glob" => "json/*/*", "format" => "json" }
+          File.write(".ultragrep.yml", config.to_yaml)
+          write "json/host.1/a.log-#{date}.json", %{{"time":"#{time}","account_id":1,"user":{"name":"bob"}}\n} +
+            %{{"time":"#{time}","account_id":12,"user":{"name":"al"}}\n}
+        end
+
+        it "frames one request per line without lua" do
+          ultragrep("-l json account_id").scan(/"account_id":\d+/).should == ['"account_id":1', '"account_id":12']
+        end
+
+        it "tests record values with --key" do
+          ultragrep("-l json -k account_id=1 account").scan(/"account_id":\d+/).should == ['"account_id":1']
+          ultragrep("-l json -k 'account_id>1' -k user.name=al account").scan(/"account_id":\d+/).should == ['"account_id":12']
+          ultragrep("-l json -k user.name=carol account").strip.should == ""
+        end
+      end
+
+      context "a request too big to hold in memory" do
+        before do
+          dump = "  #{"x" * 99}\n" * 200_000
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time}\n#{dump}  needle\n\n\n" +
+            "Processing xxx/2 at #{time}\n#{dump}\n\n\nProcessing xxx/3 at #{time}\n"
+        end
+
+        it "matches it as it goes by, and prints it whole" do
+          output = ultragrep("'ne+dle'")
+          output.scan(/Processing \S+/).should == ["Processing xxx/1"]
+          output.should include "#{"x" * 99}\n  needle\n"
+          output.count("\n").should > 200_000
+          ultragrep("--not needle xxx").scan(/Processing \S+/).should == ["Processing xxx/2", "Processing xxx/3"]
+        end
+
+        it "lets go of it when the framer hands it over as a string" do
+          write "string.lua", <<-LUA
+            strptime_format = "%Y-%m-%d %H:%M:%S"
+            lines, offset, ts = {}, 0, nil
+
+            function process_line(line, line_offset)
+              if line:find("^Processing") then
+                on_eof()
+                lines, offset, ts = {}, line_offset, line:match("at (%d+%-%d+%-%d+ %d+:%d+:%d+)")
+              end
+              lines[#lines + 1] = line
+            end
+
+            function on_eof()
+              if ts then ug_request.add(table.concat(lines), ts, offset) end
+            end
+          LUA
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").tap { |c| c["types"]["app"]["lua"] = File.expand_path("string.lua") }.to_yaml)
+          short = "Processing yyy at #{time}\n  short\n\n\n"
+          write "foo/host.1/a.log-#{date}", File.read("foo/host.1/a.log-#{date}").sub("Processing xxx/2", short + "Processing xxx/2")
+
+          ultragrep("'ne+dle'").scan(/Processing \S+/).should == ["Processing xxx/1"]
+          ultragrep("--not needle xxx").scan(/Processing \S+/).should == ["Processing xxx/2", "Processing xxx/3"]
+        end
+      end
+
+      context "--match-limit" do
+        before do
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time}\n  #{"a" * 40}!\n\n\n" +
+            "Processing xxx/2 at #{time}\n  b!\n"
+        end
+
+        it "leaves out the requests a regexp runs out of backtracking on, and says so" do
+          output = ultragrep("--match-limit 10000 xxx --not '(a+)+$'")
+          output.scan(/Processing \S+/).should == ["Processing xxx/2"]
+          output.should include '1 request left out: "(a+)+$" ran into the match limit'
+        end
+
+        it "stops the search with match_limit_policy: abort" do
+          File.write(".ultragrep.yml", YAML.load_file(".ultragrep.yml").merge("match_limit_policy" => "abort").to_yaml)
+          ultragrep("--match-limit 10000 xxx --not '(a+)+$'", :fail => true).should include "Stopped"
+        end
+      end
+
+      context "--estimate" do
+        before do
+          write "foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time}\n\n\nProcessing xxx/2 at #{time}\n\n\nProcessing yyy at #{time}\n"
+        end
+
+        it "prints how many requests match instead of them" do
+          output = ultragrep("xxx --estimate 10")
+          output.should include "about 2 matching requests"
+          output.should_not include "Processing"
+        end
+
+        it "counts all of the logs when they can be read in time" do
+          run "#{Bundler.root}/bin/ultragrep_build_indexes -t app"
+          ultragrep("Processing --estimate 10").should include "about 3 matching requests (95% confidence: 3 - 3)"
+        end
+
+        it "refuses --max-count" do
+          ultragrep("xxx --estimate 10 -m 1", :fail => true).should include "--estimate"
+        end
+      end
+
       context "--progress" do
         before do
           write "foo/host.1/a.log-#{date}", "UNMATCHED"
@@ -413,12 +726,106 @@ Processing -10 at 2012-01-01 01:00:00\n\n
             index_dumped.should == "1325376000 0\n1325376060 40\n1325376070 80\n1325376230 120\n1325379600 200\n"
 
           end
+
+          it "cats from the indexed request, not the access point before it" do
+            output = run "#{Bundler.root}/src/ug_cat #{log_file}.gz 1325376235"
+            output.should start_with "Processing -40"
+          end
+
+          it "stops catting where the index says the end time is past" do
+            output = run "#{Bundler.root}/src/ug_cat #{log_file}.gz 1325376000 1325376100"
+            output.scan(/Processing \S+/).should == ["Processing -60", "Processing -50", "Processing -44"]
+          end
+        end
+      end
+
+      describe "ug_cat without an index" do
+        before do
+          write log_file, (0...50_000).map { |i| "Processing #{i} at #{Time.at(1325376000 + i).utc.strftime(time_format)}\n  #{"x" * 20}\n\n\n" }.join
+        end
+
+        it "bisects a plain log for the start time with the framer" do
+          output = run "#{Bundler.root}/src/ug_cat -l #{File.dirname(__FILE__) + "/../lua/rails.lua"} #{log_file} #{1325376000 + 40_000}"
+          output.bytesize.should < File.size(log_file) / 2
+          output.should include "\nProcessing 40000 at"
+          output.should_not include "\nProcessing 1000 at"
         end
 
       end
     end
   end
 
+  describe "agents" do
+    before { @agent_pids = [] }
+
+    after do
+      @agent_pids.each do |pid|
+        Process.kill("TERM", pid)
+        Process.wait(pid)
+      end
+    end
+
+    def start_agent(dir)
+      server = TCPServer.new("127.0.0.1", 0)
+      port = server.addr[1]
+      server.close
+
+      FileUtils.mkdir_p(dir)
+      FileUtils.cp(".ultragrep.yml", dir)
+      @agent_pids << spawn("#{Bundler.root}/bin/ultragrep_agent --bind 127.0.0.1 --port #{port}", :chdir => dir, [:out, :err] => "/dev/null")
+      50.times do
+        begin
+          TCPSocket.new("127.0.0.1", port).close
+          break
+        rescue Errno::ECONNREFUSED
+          sleep 0.1
+        end
+      end
+      "127.0.0.1:#{port}"
+    end
+
+    it "merges matches from several agents in time order" do
+      write "node1/foo/host.1/a.log-#{date}", "Processing xxx at #{time_at(10)}\n"
+      write "node2/foo/host.2/a.log-#{date}", "Processing yyy at #{time_at(20)}\n\n\nProcessing zzz at #{time_at(5)}\n"
+      agents = [start_agent("node1"), start_agent("node2")]
+
+      output = ultragrep("Processing --agent #{agents.join(" --agent ")}")
+      output.scan(/Processing (\w+)/).flatten.should == ["yyy", "xxx", "zzz"]
+      output.should include "# foo/host.1/a.log-#{date}"
+    end
+
+    it "answers a malformed query with an error and keeps serving" do
+      write "node1/foo/host.1/a.log-#{date}", "Processing xxx at #{time_at(10)}\n"
+      agent = start_agent("node1")
+      ['{"range_start":0,"range_end":1}', '{"range_start":0,"range_end":1,"regexps":"xxx"}', '[]'].each do |query|
+        socket = TCPSocket.new(*agent.split(":"))
+        socket.puts(query)
+        socket.read.should include "@@error"
+        socket.close
+      end
+
+      # what reaches ug_guts' command line has to be what it says it is
+      ['{"range_start":0,"range_end":1,"regexps":["x"],"max_count":"1; touch pwned"}',
+       '{"range_start":0,"range_end":1,"regexps":["x"],"where":"a"}'].each do |query|
+        socket = TCPSocket.new(*agent.split(":"))
+        socket.puts(query)
+        socket.read.should include "@@error bad query"
+        socket.close
+      end
+      File.exist?("node1/pwned").should be false
+
+      ultragrep("Processing --agent #{agent}").should include "Processing xxx"
+    end
+
+    it "passes --match-limit on to the agents" do
+      write "node1/foo/host.1/a.log-#{date}", "Processing xxx/1 at #{time_at(10)}\n  #{"a" * 40}!\n\n\n" +
+        "Processing xxx/2 at #{time_at(10)}\n  b!\n"
+      output = ultragrep("--match-limit 10000 xxx --not '(a+)+$' --agent #{start_agent("node1")}")
+      output.scan(/Processing \S+/).should == ["Processing xxx/2"]
+      output.should include '1 request left out: "(a+)+$" ran into the match limit'
+    end
+  end
+
   describe ".parse_time" do
     let(:zone_offset) { Time.zone_offset(Time.now.zone) }
 
@@ -464,6 +871,34 @@ Processing -10 at 2012-01-01 01:00:00\n\n
     end
   end
 
+  describe Ultragrep::Throttle do
+    let(:throttle) { Ultragrep::Throttle.new([], "min" => 1, "max" => 3) }
+    after { throttle.stop }
+
+    it "adds a worker while the disks have room and every slot is busy" do
+      throttle.adjust(0.1, 0.5)
+      throttle.limit.should == 1
+      throttle.acquire
+      throttle.adjust(0.1, 0.5)
+      throttle.limit.should == 2
+    end
+
+    it "doesn't add one without spare CPU" do
+      throttle.acquire
+      throttle.adjust(0.1, 0.05)
+      throttle.limit.should == 1
+    end
+
+    it "backs off when the disks are busier than the target, down to min" do
+      throttle.acquire
+      throttle.adjust(0.1, 0.5)
+      throttle.adjust(0.95, 0.5)
+      throttle.limit.should == 1
+      throttle.adjust(0.95, 0.5)
+      throttle.limit.should == 1
+    end
+  end
+
   describe Ultragrep::LogCollector do
     describe ".filter_and_group_files" do
       it "returns everything when not filtering by host" do
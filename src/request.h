@@ -2,9 +2,16 @@
 #define __REQUEST_H__
 
 #include <time.h>
+#include <sys/types.h>
 
+/*
+ * buf is either a string handed over by the framer, or NULL when the framer
+ * only reported the request's extent (offset, length) -- in that case the
+ * consumer resolves it against its own read buffer.
+ */
 typedef struct request_t {
     char *buf;
+    size_t length;
     off_t offset;
     time_t time;
 } request_t;
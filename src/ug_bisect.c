@@ -0,0 +1,92 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ug_lua.h"
+#include "ug_buffer.h"
+#include "ug_bisect.h"
+
+int ug_bisecting;
+
+/* what the probe in progress has seen */
+static int reported;
+static off_t found_offset;
+static time_t found_time;
+
+void ug_bisect_request(request_t * req)
+{
+    /* the first one may have started before the probe */
+    if (reported++ == 0 || found_offset >= 0 || !req->time)
+        return;
+    found_offset = req->offset;
+    found_time = req->time;
+}
+
+/*
+ * frame the log from offset on, a chunk at a time, until the framer reports
+ * a whole request with a time in it.  its offset, or -1 if there's none in
+ * UG_BISECT_PROBE_BYTES.  small preads: we don't want the kernel reading
+ * ahead for a read that's over in a few kilobytes.
+ */
+static off_t probe(FILE * log, lua_State * lua, off_t offset, time_t * time)
+{
+    ug_buffer_t buf;
+    char chunk[UG_BISECT_CHUNK], *line;
+    ssize_t n;
+    size_t len;
+    off_t line_offset, end = offset + UG_BISECT_PROBE_BYTES;
+
+    bzero(&buf, sizeof(ug_buffer_t));
+    ug_buffer_reset(&buf, offset);
+    ug_lua_reset(lua);
+    reported = 0;
+    found_offset = -1;
+
+    while (found_offset < 0 && offset < end && (n = pread(fileno(log), chunk, sizeof(chunk), offset)) > 0) {
+        ug_buffer_append(&buf, chunk, n);
+        offset += n;
+        while (found_offset < 0 && (line = ug_buffer_next_line(&buf, &len, &line_offset)))
+            ug_process_line(lua, line, len, line_offset);
+        buf.keep = buf.base + buf.scanned;
+    }
+    free(buf.data);
+
+    *time = found_time;
+    return found_offset;
+}
+
+/*
+ * where to start reading a plain log that has no index, for the requests
+ * from start_time on: the start of a request that's earlier than that, found
+ * by probing halfway between the last one we know is early enough and the
+ * first spot we know is too late.  that's O(log n) probes of a few kilobytes
+ * each, instead of framing the log from the top.  like the index, it takes
+ * the log to be in time order.  leaves the framer reset.
+ */
+off_t ug_bisect(FILE * log, lua_State * lua, time_t start_time)
+{
+    struct stat st;
+    off_t lo = 0, hi, mid, found;
+    time_t time;
+
+    if (start_time <= 0 || fstat(fileno(log), &st) == -1)
+        return 0;
+
+    ug_bisecting = 1;
+    for (hi = st.st_size; hi - lo > UG_BISECT_MIN_BYTES;) {
+        mid = lo + (hi - lo) / 2;
+        found = probe(log, lua, mid, &time);
+        if (found < 0 || found >= hi || time >= start_time)
+            hi = mid;
+        else
+            lo = found;
+    }
+    ug_bisecting = 0;
+
+    ug_lua_reset(lua);
+    return lo;
+}
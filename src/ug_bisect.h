@@ -0,0 +1,22 @@
+#ifndef _UG_BISECT_H
+#define _UG_BISECT_H
+
+#include <stdio.h>
+#include <time.h>
+#include <lua.h>
+#include "request.h"
+
+/* stop bisecting once there's this little left: framing it is cheaper than more probes */
+#define UG_BISECT_MIN_BYTES (1024 * 1024)
+/* how far past a probe we'll frame looking for a whole request with a time */
+#define UG_BISECT_PROBE_BYTES (4 * 1024 * 1024)
+/* what a probe reads at a time */
+#define UG_BISECT_CHUNK 65536
+
+/* while ug_bisect() runs, handle_request() gives the framer's requests to ug_bisect_request() */
+extern int ug_bisecting;
+
+off_t ug_bisect(FILE * log, lua_State * lua, time_t start_time);
+void ug_bisect_request(request_t * req);
+
+#endif
@@ -0,0 +1,166 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ug_buffer.h"
+
+void ug_buffer_reset(ug_buffer_t * b, off_t offset)
+{
+    b->len = b->scanned = 0;
+    b->start = b->base = b->keep = b->advised = b->dropped = offset;
+    b->end = -1;
+}
+
+/* make room for at least n more bytes at the end of the buffer */
+void ug_buffer_reserve(ug_buffer_t * b, size_t n)
+{
+    size_t drop;
+
+    if ( b->allocated - b->len >= n )
+        return;
+
+    drop = b->keep - b->base;
+    if ( drop > b->scanned )
+        drop = b->scanned;
+    if ( drop > 0 ) {
+        memmove(b->data, b->data + drop, b->len - drop);
+        b->len -= drop;
+        b->scanned -= drop;
+        b->base += drop;
+    }
+
+    while ( b->allocated - b->len < n ) {
+        b->allocated = b->allocated ? b->allocated * 2 : UG_READ_BLOCK * 2;
+        b->data = realloc(b->data, b->allocated);
+        if ( !b->data ) {
+            perror("Couldn't grow read buffer");
+            exit(1);
+        }
+    }
+}
+
+void ug_buffer_append(ug_buffer_t * b, const void *data, size_t len)
+{
+    ug_buffer_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/*
+ * one read() straight into the buffer -- no stdio copy, and on a pipe we get
+ * what's there instead of waiting for a full block.  0 at end of file.
+ *
+ * reading a file, stream offsets are file offsets, and we keep UG_READAHEAD
+ * bytes past the read asked for with POSIX_FADV_WILLNEED: the kernel reads
+ * them in while we're matching what we have, instead of after we ask.
+ *
+ * with drop_behind, what we've read is dropped from the page cache as we go:
+ * a scan of an old archive shouldn't push out what other processes on the
+ * box are using.
+ *
+ * with an end, neither the read nor the readahead go past it: a stretch
+ * between two index entries is often much smaller than a block.
+ */
+ssize_t ug_buffer_read(ug_buffer_t * b, FILE * file)
+{
+    ssize_t nread;
+    size_t want = UG_READ_BLOCK;
+    off_t at = b->base + b->len, end, ahead;
+
+    if ( b->end >= 0 ) {
+        if ( at >= b->end )
+            return 0;
+        if ( b->end - at < (off_t) want )
+            want = b->end - at;
+    }
+    end = at + want;
+    ahead = end + UG_READAHEAD;
+    if ( b->end >= 0 && ahead > b->end )
+        ahead = b->end;
+
+    if ( b->advised >= 0 && b->advised < end )
+        b->advised = end;
+    if ( b->advised >= 0 && b->advised < ahead && (b->advised < ahead - UG_READ_BLOCK || ahead == b->end) ) {
+        if ( posix_fadvise(fileno(file), b->advised, ahead - b->advised, POSIX_FADV_WILLNEED) == 0 )
+            b->advised = ahead;
+        else
+            b->advised = -1;
+    }
+
+    ug_buffer_reserve(b, want);
+    do {
+        nread = read(fileno(file), b->data + b->len, want);
+    } while ( nread == -1 && errno == EINTR );
+
+    if ( nread > 0 )
+        b->len += nread;
+
+    if ( b->drop_behind && b->advised >= 0 && b->base + (off_t) b->len - b->dropped >= UG_DROP_BATCH ) {
+        posix_fadvise(fileno(file), b->dropped, b->base + b->len - b->dropped, POSIX_FADV_DONTNEED);
+        b->dropped = b->base + b->len;
+    }
+    return nread;
+}
+
+/* memchr() is vectorized in any libc we care about, which beats a byte at a time loop by a mile */
+char *ug_buffer_next_line(ug_buffer_t * b, size_t * len, off_t * offset)
+{
+    char *line = b->data + b->scanned, *eol;
+    size_t avail = b->len - b->scanned;
+
+    /* a piece never ends right in front of the newline: that would make a blank line of it */
+    eol = memchr(line, '\n', b->max_line && avail > b->max_line ? b->max_line + 1 : avail);
+    if ( eol )
+        *len = (eol - line) + 1;
+    else if ( b->max_line && avail > b->max_line )
+        *len = b->max_line;
+    else
+        return NULL;
+
+    *offset = b->base + b->scanned;
+    b->scanned += *len;
+    return line;
+}
+
+char *ug_buffer_rest(ug_buffer_t * b, size_t * len, off_t * offset)
+{
+    char *line = b->data + b->scanned;
+
+    if ( b->scanned == b->len )
+        return NULL;
+
+    *len = b->len - b->scanned;
+    *offset = b->base + b->scanned;
+    b->scanned = b->len;
+    return line;
+}
+
+void ug_buffer_trim(ug_buffer_t * b, request_t * req)
+{
+    /* framers start out assuming the stream starts at 0, which it doesn't after a seek */
+    if ( req->offset < b->start && req->offset + (off_t) req->length > b->start ) {
+        req->length -= b->start - req->offset;
+        req->offset = b->start;
+    }
+}
+
+int ug_buffer_resolve(ug_buffer_t * b, request_t * req)
+{
+    if ( req->buf ) {
+        if ( req->offset > b->keep )
+            b->keep = req->offset;
+        return 1;
+    }
+
+    ug_buffer_trim(b, req);
+    if ( req->offset < b->base || req->offset + (off_t) req->length > b->base + (off_t) b->len ) {
+        fprintf(stderr, "request at %lld (%zu bytes) is outside of the read buffer\n", (long long) req->offset, req->length);
+        return 0;
+    }
+    req->buf = b->data + (req->offset - b->base);
+    b->keep = req->offset + req->length;
+    return 1;
+}
@@ -0,0 +1,57 @@
+#ifndef _UG_BUFFER_H
+#define _UG_BUFFER_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "request.h"
+
+/*
+ * a read buffer that's filled in large blocks and handed out a line at a time.
+ * the bytes of a line stay where they are until the owner moves "keep" past
+ * them, so a framer can report a request as an (offset, length) extent and we
+ * can still find it in the buffer afterwards.
+ */
+#define UG_READ_BLOCK (4 * 1024 * 1024)
+/* how far past what we've read we keep the kernel reading, so the disk isn't idle while we match */
+#define UG_READAHEAD (16 * 1024 * 1024)
+/* with drop_behind, how much we let pile up in the page cache behind us before dropping it */
+#define UG_DROP_BATCH (16 * 1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t allocated;
+    size_t scanned;             /* data up to here has been handed out */
+    off_t start;                /* stream offset we started reading at */
+    off_t base;                 /* stream offset of data[0] */
+    off_t keep;                 /* stream offset of the oldest byte we may still be asked for */
+    off_t advised;              /* the kernel's been asked to read the file up to here; -1 for pipes */
+    off_t end;                  /* don't read (or ask the kernel to read) past here; -1 for the end of the file */
+    int drop_behind;            /* drop what we've read from the page cache, see ug_buffer_read() */
+    off_t dropped;
+    size_t max_line;            /* longer lines are handed out in pieces this long; 0 for no limit */
+} ug_buffer_t;
+
+void ug_buffer_reset(ug_buffer_t * b, off_t offset);
+void ug_buffer_reserve(ug_buffer_t * b, size_t n);
+void ug_buffer_append(ug_buffer_t * b, const void *data, size_t len);
+ssize_t ug_buffer_read(ug_buffer_t * b, FILE * file);
+
+/*
+ * the next complete line (newline included), or NULL if there's none yet.
+ * with max_line, a line longer than that comes out in pieces without a
+ * newline, so one enormous line doesn't have to be read in whole first.
+ */
+char *ug_buffer_next_line(ug_buffer_t * b, size_t * len, off_t * offset);
+/* whatever is left over after the last newline, at the end of the stream */
+char *ug_buffer_rest(ug_buffer_t * b, size_t * len, off_t * offset);
+
+/* cut off the part of a request that's before where we started reading */
+void ug_buffer_trim(ug_buffer_t * b, request_t * req);
+/*
+ * point a request the framer reported as an extent at its bytes in the
+ * buffer, and let go of what's before it. 0 if it isn't in the buffer.
+ */
+int ug_buffer_resolve(ug_buffer_t * b, request_t * req);
+
+#endif
@@ -11,8 +11,15 @@
 #include "ug_index.h"
 #include "ug_lua.h"
 #include "ug_gzip.h"
+#include "ug_buffer.h"
+#include "ug_meta.h"
 
-#define USAGE "Usage: ug_build_index process.lua file\n"
+#define USAGE "Usage: ug_build_index [-F name=regexp ...] process.lua file\n\n" \
+              "  process.lua may be json[:field], for the built-in JSON-lines framer\n" \
+              "  -F name=regexp  also write a .meta sidecar with the field's value for each request\n" \
+              "                  (the regexp's first group, or all of what it matched)\n"
+
+#define MAX_FIELDS 32
 
 // index file format
 // [64bit,64bit] -- timestamp, file offset 
@@ -20,10 +27,48 @@
 
 static build_idx_context_t ctx;
 
+static int num_fields;
+static char *field_names[MAX_FIELDS];     /* name=regexp, as given */
+static pcre *field_res[MAX_FIELDS];
+static ug_meta_t *meta;
+static time_t last_request_time;
+
+/* pull the fields out of the request, and add its row to the sidecar */
+void add_meta_row(request_t *req)
+{
+    char *values[MAX_FIELDS];
+    size_t lens[MAX_FIELDS];
+    int i, rc, ovector[30];
+
+    if (!ug_buffer_resolve(ctx.lines, req))
+        return;
+
+    if (!req->time)
+        req->time = last_request_time;
+    last_request_time = req->time;
+
+    for (i = 0; i < num_fields; i++) {
+        values[i] = NULL;
+        lens[i] = 0;
+        rc = pcre_exec(field_res[i], NULL, req->buf, req->length, 0, 0, ovector, 30);
+        if (rc >= 2 && ovector[2] >= 0) {
+            values[i] = req->buf + ovector[2];
+            lens[i] = ovector[3] - ovector[2];
+        } else if (rc >= 0) {
+            values[i] = req->buf + ovector[0];
+            lens[i] = ovector[1] - ovector[0];
+        }
+    }
+    ug_meta_add(meta, req, values, lens);
+}
 
 void handle_request(request_t *req)
 {
     time_t floored_time;
+
+    /* a plain log's last request may still be getting written; the next run picks it up */
+    if (meta && !(ctx.at_eof && !ctx.fgzindex))
+        add_meta_row(req);
     floored_time = req->time - (req->time % INDEX_EVERY);
     if (!ctx.last_index_time || floored_time > ctx.last_index_time) {
         ug_write_index(ctx.findex, floored_time, req->offset);
@@ -31,7 +76,7 @@ void handle_request(request_t *req)
     }
 }
 
-void open_indexes(char *log_fname)
+void open_indexes(char *log_fname, int fresh)
 {
     char *index_fname, *gz_index_fname;
 
@@ -49,7 +94,7 @@ void open_indexes(char *log_fname)
             exit(1);
         }
     } else {
-        ctx.findex = fopen(index_fname, "r+");
+        ctx.findex = fresh ? NULL : fopen(index_fname, "r+");
         if (ctx.findex) {
             /* seek in the log, (and the index, with get_offset_for_timestamp()) to the 
              * last timestamp we indexed */
@@ -64,19 +109,52 @@ void open_indexes(char *log_fname)
     }
 }
 
+/* -F name=regexp */
+void add_field(char *arg)
+{
+    char *eq;
+    const char *error;
+    int erroffset;
+
+    eq = strchr(arg, '=');
+    if (!eq || eq == arg || num_fields == MAX_FIELDS) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    field_names[num_fields] = strdup(arg);
+    field_res[num_fields] = pcre_compile(eq + 1, 0, &error, &erroffset, NULL);
+    if (!field_res[num_fields]) {
+        fprintf(stderr, "Error compiling regexp \"%s\": %s\n", eq + 1, error);
+        exit(1);
+    }
+    num_fields++;
+}
+
 int main(int argc, char **argv)
 {
-    char *line = NULL, *lua_fname, *log_fname;
-    ssize_t line_size;
-    size_t allocated;
+    extern int optind;
+    char *line, *lua_fname, *log_fname;
+    size_t line_size;
+    off_t offset;
+    ug_buffer_t buf;
+    int opt, gzipped, fresh = 0;
+
+    while ((opt = getopt(argc, argv, "F:")) != -1) {
+        if (opt != 'F') {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        add_field(optarg);
+    }
 
-    if (argc < 3) {
+    if (argc - optind < 2) {
         fprintf(stderr, USAGE);
         exit(1);
     }
 
-    lua_fname = argv[1];
-    log_fname = argv[2];
+    lua_fname = argv[optind];
+    log_fname = argv[optind + 1];
+    gzipped = strcmp(log_fname + (strlen(log_fname) - 3), ".gz") == 0;
 
     bzero(&ctx, sizeof(build_idx_context_t));
 
@@ -88,22 +166,35 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    open_indexes(log_fname);
+    if (num_fields) {
+        meta = ug_meta_create(ug_get_index_fname(log_fname, "meta"), ctx.flog, field_names, num_fields, !gzipped);
+        if (!meta)
+            exit(1);
+        /* a new sidecar (or one for other fields) needs the whole log read again */
+        fresh = meta->covered == 0;
+        ctx.hold_lines = 1;
+    }
 
-    if (strcmp(log_fname + (strlen(log_fname) - 3), ".gz") == 0) {
+    open_indexes(log_fname, fresh);
+
+    if (gzipped) {
         build_gz_index(&ctx);
     } else {
-        while (1) {
-            off_t offset;
-            offset = ftello(ctx.flog);
-            line_size = getline(&line, &allocated, ctx.flog);
-
-            if ( line_size < 0 )
-                break;
-
-            ug_process_line(ctx.lua, line, line_size, offset);
+        bzero(&buf, sizeof(ug_buffer_t));
+        ug_buffer_reset(&buf, ftello(ctx.flog));
+        ctx.lines = &buf;
+        while ( ug_buffer_read(&buf, ctx.flog) > 0 ) {
+            while ( (line = ug_buffer_next_line(&buf, &line_size, &offset)) )
+                ug_process_line(ctx.lua, line, line_size, offset);
+            if (!ctx.hold_lines)
+                buf.keep = buf.base + buf.scanned;
         }
+        if ( (line = ug_buffer_rest(&buf, &line_size, &offset)) )
+            ug_process_line(ctx.lua, line, line_size, offset);
+        ctx.at_eof = 1;
+        ug_lua_on_eof(ctx.lua);
     }
-    ug_lua_on_eof(ctx.lua);
+    if (meta)
+        ug_meta_close(meta);
     exit(0);
 }
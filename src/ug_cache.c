@@ -0,0 +1,338 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ug_index.h"
+#include "ug_cache.h"
+
+/*
+ * cache file format -- a series of entries, the newest last:
+ * [ug_cache_header]
+ * [key_len bytes] -- framer, then the sorted regexps, each NUL-terminated
+ * [num_spans * ug_span_t]
+ *
+ * the file is only ever replaced whole (see ug_cache_store()), and each
+ * entry's checksum covers its key and spans: an entry that doesn't add up
+ * reads as the end of the file.
+ */
+#define UG_CACHE_MAGIC 0x32434755       /* "UGC2" */
+
+struct ug_cache_header {
+    uint32_t magic;
+    uint32_t key_len;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t num_spans;
+    uint64_t checksum;
+};
+
+/* FNV-1a */
+static uint64_t checksum(uint64_t sum, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while (len--)
+        sum = (sum ^ *p++) * 0x100000001b3ULL;
+    return sum;
+}
+
+static uint64_t entry_checksum(char *key, uint32_t key_len, ug_span_t * spans, uint64_t num_spans)
+{
+    return checksum(checksum(0xcbf29ce484222325ULL, key, key_len), spans, sizeof(ug_span_t) * num_spans);
+}
+
+/* the next entry's header and key; 0 at the end of the file, or at anything that isn't an entry */
+static int read_entry(FILE * file, struct ug_cache_header *header, char **key)
+{
+    if (!fread(header, sizeof(*header), 1, file) || header->magic != UG_CACHE_MAGIC
+        || header->num_spans > UG_CACHE_MAX_SPANS || header->key_len > (1 << 24))
+        return 0;
+
+    *key = malloc(header->key_len ? header->key_len : 1);
+    if (fread(*key, header->key_len, 1, file) != 1 && header->key_len) {
+        free(*key);
+        return 0;
+    }
+    return 1;
+}
+
+/* the entry's spans, which read_entry() left to be read; NULL if they aren't what its checksum says */
+static ug_span_t *read_spans(FILE * file, struct ug_cache_header *header, char *key)
+{
+    ug_span_t *spans = malloc(sizeof(ug_span_t) * (header->num_spans ? header->num_spans : 1));
+
+    if (fread(spans, sizeof(ug_span_t), header->num_spans, file) != header->num_spans
+        || entry_checksum(key, header->key_len, spans, header->num_spans) != header->checksum) {
+        free(spans);
+        return NULL;
+    }
+    return spans;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+ug_cache_t *ug_cache_open(char *log_fname, FILE * log, char *framer, char **regexps, int num_regexps,
+                          time_t start_time, time_t end_time)
+{
+    ug_cache_t *cache;
+    struct stat st;
+    char **terms, *p;
+    int i;
+
+    if (fstat(fileno(log), &st) == -1)
+        return NULL;
+
+    cache = calloc(1, sizeof(ug_cache_t));
+    cache->fname = ug_get_index_fname(log_fname, "ugcache");
+    cache->inode = st.st_ino;
+    cache->size = st.st_size;
+    cache->mtime = st.st_mtime;
+    cache->start_time = start_time;
+    cache->end_time = end_time;
+
+    /* "foo" and "+foo" are the same search, and the order of the regexps doesn't matter */
+    terms = malloc(sizeof(char *) * num_regexps);
+    cache->key_len = strlen(framer) + 1;
+    for (i = 0; i < num_regexps; i++) {
+        if (regexps[i][0] == '+' || regexps[i][0] == '!') {
+            terms[i] = strdup(regexps[i]);
+        } else {
+            terms[i] = malloc(strlen(regexps[i]) + 2);
+            sprintf(terms[i], "+%s", regexps[i]);
+        }
+        cache->key_len += strlen(terms[i]) + 1;
+    }
+    qsort(terms, num_regexps, sizeof(char *), compare_strings);
+
+    p = cache->key = malloc(cache->key_len);
+    strcpy(p, framer);
+    p += strlen(framer) + 1;
+    for (i = 0; i < num_regexps; i++) {
+        if (i > 0 && strcmp(terms[i], terms[i - 1]) == 0) {
+            cache->key_len -= strlen(terms[i]) + 1;
+        } else {
+            strcpy(p, terms[i]);
+            p += strlen(terms[i]) + 1;
+        }
+        free(terms[i]);
+    }
+    free(terms);
+
+    return cache;
+}
+
+/* is key's search part of of's -- same framer, and a subset of its regexps? */
+static int key_is_subset(char *key, uint32_t key_len, char *of, uint32_t of_len)
+{
+    char *p, *q, *key_end = key + key_len, *of_end = of + of_len;
+
+    if (!key_len || key[key_len - 1] != '\0' || strcmp(key, of) != 0)
+        return 0;
+
+    for (p = key + strlen(key) + 1; p < key_end; p += strlen(p) + 1) {
+        for (q = of + strlen(of) + 1; q < of_end; q += strlen(q) + 1) {
+            if (strcmp(p, q) == 0)
+                break;
+        }
+        if (q >= of_end)
+            return 0;
+    }
+    return 1;
+}
+
+static int same_log(struct ug_cache_header *header, ug_cache_t * cache)
+{
+    return header->inode == cache->inode && header->size == cache->size && header->mtime == cache->mtime;
+}
+
+/*
+ * find the smallest cached result our query can be answered from.  returns 0
+ * if there's none, 1 if the caller needs to re-check the requests in *spans, 2
+ * if it's a result for exactly this query.
+ */
+int ug_cache_lookup(ug_cache_t * cache, ug_span_t ** spans, size_t * num_spans)
+{
+    struct ug_cache_header header;
+    FILE *file;
+    char *key;
+    ug_span_t *entry_spans;
+    int found = 0;
+
+    *spans = NULL;
+    *num_spans = 0;
+
+    file = fopen(cache->fname, "r");
+    if (!file)
+        return 0;
+
+    while (read_entry(file, &header, &key)) {
+        if (same_log(&header, cache)
+            && header.start_time <= (uint64_t) cache->start_time
+            && header.end_time >= (uint64_t) cache->end_time
+            && key_is_subset(key, header.key_len, cache->key, cache->key_len)
+            && (!found || header.num_spans < *num_spans)) {
+            if (!(entry_spans = read_spans(file, &header, key))) {
+                free(key);
+                break;
+            }
+            free(*spans);
+            *spans = entry_spans;
+            *num_spans = header.num_spans;
+
+            if (header.start_time == (uint64_t) cache->start_time && header.end_time == (uint64_t) cache->end_time
+                && header.key_len == cache->key_len && memcmp(key, cache->key, cache->key_len) == 0)
+                found = 2;
+            else
+                found = 1;
+
+            free(key);
+            continue;
+        }
+
+        free(key);
+        if (fseeko(file, header.num_spans * sizeof(ug_span_t), SEEK_CUR) == -1)
+            break;
+    }
+
+    fclose(file);
+    return found;
+}
+
+void ug_cache_add(ug_cache_t * cache, request_t * req)
+{
+    if (cache->overflow)
+        return;
+
+    if (cache->num_spans == UG_CACHE_MAX_SPANS) {
+        cache->overflow = 1;
+        return;
+    }
+
+    if (cache->num_spans == cache->allocated) {
+        cache->allocated = cache->allocated ? cache->allocated * 2 : 1024;
+        cache->spans = realloc(cache->spans, sizeof(ug_span_t) * cache->allocated);
+    }
+
+    cache->spans[cache->num_spans].time = req->time;
+    cache->spans[cache->num_spans].offset = req->offset;
+    cache->spans[cache->num_spans].length = req->length;
+    cache->num_spans++;
+}
+
+/*
+ * an entry already in the file is worth keeping next to ours if it's for
+ * this version of the log, and answers something ours can't: a longer time
+ * range, or a search with fewer regexps.
+ */
+static int keep_entry(struct ug_cache_header *header, char *key, ug_cache_t * cache)
+{
+    return same_log(header, cache)
+        && !(header->start_time >= (uint64_t) cache->start_time && header->end_time <= (uint64_t) cache->end_time
+             && key_is_subset(cache->key, cache->key_len, key, header->key_len));
+}
+
+/*
+ * rewrite the file with the matches we collected added, and the entries they
+ * make useless (and all but the newest UG_CACHE_MAX_ENTRIES) left out.  it's
+ * written under a temporary name and renamed into place, so a search reading
+ * it, or writing it at the same time, sees one whole file or the other -- the
+ * last writer's entry wins.  a cache we can't write is just not a cache.
+ */
+void ug_cache_store(ug_cache_t * cache)
+{
+    struct ug_cache_header header;
+    FILE *file, *old;
+    char *key, *tmp;
+    ug_span_t *spans;
+    size_t kept = 0, skip = 0;
+    sigset_t signals, saved;
+
+    if (cache->overflow)
+        return;
+
+    tmp = malloc(strlen(cache->fname) + 32);
+    sprintf(tmp, "%s.%d", cache->fname, (int) getpid());
+
+    /* the driver's --max-count stops us with a SIGTERM; it can wait for this */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &signals, &saved);
+
+    if (!(file = fopen(tmp, "w")))
+        goto done;
+
+    if ((old = fopen(cache->fname, "r"))) {
+        while (read_entry(old, &header, &key)) {
+            kept += keep_entry(&header, key, cache);
+            free(key);
+            if (fseeko(old, header.num_spans * sizeof(ug_span_t), SEEK_CUR) == -1)
+                break;
+        }
+        if (kept >= UG_CACHE_MAX_ENTRIES)
+            skip = kept - (UG_CACHE_MAX_ENTRIES - 1);
+
+        rewind(old);
+        while (read_entry(old, &header, &key)) {
+            if (!keep_entry(&header, key, cache)) {
+                free(key);
+                if (fseeko(old, header.num_spans * sizeof(ug_span_t), SEEK_CUR) == -1)
+                    break;
+                continue;
+            }
+            if (!(spans = read_spans(old, &header, key))) {
+                free(key);
+                break;
+            }
+            if (skip) {
+                skip--;
+            } else {
+                fwrite(&header, sizeof(header), 1, file);
+                fwrite(key, header.key_len, 1, file);
+                fwrite(spans, sizeof(ug_span_t), header.num_spans, file);
+            }
+            free(key);
+            free(spans);
+        }
+        fclose(old);
+    }
+
+    header.magic = UG_CACHE_MAGIC;
+    header.key_len = cache->key_len;
+    header.inode = cache->inode;
+    header.size = cache->size;
+    header.mtime = cache->mtime;
+    header.start_time = cache->start_time;
+    header.end_time = cache->end_time;
+    header.num_spans = cache->num_spans;
+    header.checksum = entry_checksum(cache->key, cache->key_len, cache->spans, cache->num_spans);
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(cache->key, cache->key_len, 1, file);
+    fwrite(cache->spans, sizeof(ug_span_t), cache->num_spans, file);
+    if (ferror(file) | fclose(file) || rename(tmp, cache->fname) == -1)
+        unlink(tmp);
+
+  done:
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    free(tmp);
+}
+
+void ug_cache_free(ug_cache_t * cache)
+{
+    free(cache->fname);
+    free(cache->key);
+    free(cache->spans);
+    free(cache);
+}
@@ -0,0 +1,50 @@
+#ifndef _UG_CACHE_H
+#define _UG_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "request.h"
+
+/* 
+ * result cache for logs that don't change anymore.  we remember which requests
+ * (time, offset, length) matched a query, keyed by the log file's identity, the
+ * time range and the set of regexps.  a later query over a range inside that
+ * one, with the same or more regexps, only needs to look at those requests.
+ */
+
+/* don't bother remembering queries that match more requests than this */
+#define UG_CACHE_MAX_SPANS 1000000
+/* how many queries' results a log's cache holds on to, the newest ones */
+#define UG_CACHE_MAX_ENTRIES 16
+
+typedef struct {
+    uint64_t time;
+    uint64_t offset;
+    uint64_t length;
+} ug_span_t;
+
+typedef struct {
+    char *fname;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+    time_t start_time;
+    time_t end_time;
+    char *key;                  /* framer and sorted regexps, each NUL-terminated */
+    uint32_t key_len;
+
+    ug_span_t *spans;           /* matches collected by this run */
+    size_t num_spans;
+    size_t allocated;
+    int overflow;
+} ug_cache_t;
+
+ug_cache_t *ug_cache_open(char *log_fname, FILE * log, char *framer, char **regexps, int num_regexps,
+                          time_t start_time, time_t end_time);
+int ug_cache_lookup(ug_cache_t * cache, ug_span_t ** spans, size_t * num_spans);
+void ug_cache_add(ug_cache_t * cache, request_t * req);
+void ug_cache_store(ug_cache_t * cache);
+void ug_cache_free(ug_cache_t * cache);
+
+#endif
@@ -4,146 +4,116 @@
 #include <stdlib.h>
 #include <string.h>
 #include <libgen.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
 #include "ug_index.h"
 #include "ug_gzip.h"
-#include "zlib.h"
+#include "ug_lua.h"
+#include "ug_bisect.h"
 
-/* target_offset is the offset in the uncompressed stream we're looking for. */
-void fill_gz_info(off_t target_offset, FILE * gz_index, unsigned char *dict_data, off_t * compressed_offset)
-{
-    off_t uncompressed_offset = 0;
-
-    for (;;) {
-        if (!fread(&uncompressed_offset, sizeof(off_t), 1, gz_index))
-            break;
-
-        if (uncompressed_offset > target_offset) {
-            return;
-        }
-
-        if (!fread(compressed_offset, sizeof(off_t), 1, gz_index))
-            break;
-
-        if (!fread(dict_data, WINSIZE, 1, gz_index))
-            break;
-    }
-    return;
-}
+/* with an end timestamp, where the index says the requests after it start */
+static off_t end_offset = -1;
 
-/* Use the index to read len bytes from offset into buf, return bytes read or
-   negative for error (Z_DATA_ERROR or Z_MEM_ERROR).  If data is requested past
-   the end of the uncompressed data, then extract() will return a value less
-   than len, indicating how much as actually read into buf.  This function
-   should not return a data error unless the file was modified since the index
-   was generated.  extract() may also return Z_ERRNO if there is an error on
-   reading or seeking the input file. */
-int ug_gzip_cat(FILE * in, uint64_t time, FILE * offset_index, FILE * gz_index)
+int write_stdout(void *arg, unsigned char *data, size_t len, off_t offset)
 {
-    int ret, bits;
-    off_t uncompressed_offset, compressed_offset;
-    z_stream strm;
-    unsigned char input[CHUNK];
-    unsigned char output[WINSIZE], dict[WINSIZE];
-
-    /* initialize file and inflate state to start there */
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    strm.avail_in = 0;
-    strm.next_in = Z_NULL;
-
-
-    bzero(dict, WINSIZE);
-
-    if (gz_index && offset_index) {
-        uncompressed_offset = ug_get_offset_for_timestamp(offset_index, time);
-        fill_gz_info(uncompressed_offset, gz_index, dict, &compressed_offset);
-
-        bits = compressed_offset >> 56;
-        compressed_offset = (compressed_offset & 0x00FFFFFFFFFFFFFF) - (bits ? 1 : 0);
-
-        ret = inflateInit2(&strm, -15);     /* raw inflate */
-        if (ret != Z_OK)
-            return ret;
-
-        ret = fseeko(in, compressed_offset, SEEK_SET);
-
-        if (ret != Z_OK)
-            return ret;
-    } else {
-        compressed_offset = bits = 0;
-        strm.avail_in = fread(input, 1, CHUNK, in);
-        strm.next_in = input;
- 
-        ret = inflateInit2(&strm, 47);
+    if (end_offset >= 0 && offset + (off_t) len >= end_offset) {
+        if (end_offset > offset)
+            fwrite(data, end_offset - offset, 1, stdout);
+        return 1;
     }
+    fwrite(data, len, 1, stdout);
+    return 0;
+}
 
+/* what a plain log is read in when it can't be sent straight to stdout */
+#define CAT_BLOCK (1024 * 1024)
+/* what one sendfile() is asked for without an end offset; it stops at EOF anyway */
+#define SENDFILE_MAX (1024 * 1024 * 1024)
 
-    if (ret == -1)
-        goto extract_ret;
-    if (bits) {
-        ret = getc(in);
-        if (ret == -1) {
-            ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
-            goto extract_ret;
-        }
-        (void) inflatePrime(&strm, bits, ret >> (8 - bits));
-    }
-
-    if (compressed_offset > 0)
-        inflateSetDictionary(&strm, dict, WINSIZE);
+/*
+ * a plain log goes from the page cache into the pipe with sendfile(), never
+ * through our memory; only where stdout won't take that (a terminal, older
+ * kernels) do we copy it ourselves, in large reads.
+ */
+void cat_plain(FILE *log, off_t offset)
+{
+    ssize_t n;
+    size_t want;
+    char *buf;
 
+    fflush(stdout);
     for (;;) {
-        strm.avail_out = WINSIZE;
-        strm.next_out = output;
-
-        if (!strm.avail_in) {
-            strm.avail_in = fread(input, 1, CHUNK, in);
-            strm.next_in = input;
+        want = SENDFILE_MAX;
+        if (end_offset >= 0) {
+            if (offset >= end_offset)
+                return;
+            if (end_offset - offset < (off_t) want)
+                want = end_offset - offset;
         }
-
-        if (ferror(in)) {
-            ret = Z_ERRNO;
-            goto extract_ret;
-        }
-
-        if (strm.avail_in == 0) {
-            ret = Z_DATA_ERROR;
-            goto extract_ret;
+        n = sendfile(fileno(stdout), fileno(log), &offset, want);
+        if (n == 0)
+            return;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            /* a non-blocking pipe that's full: wait until the reader makes room */
+            if (errno == EAGAIN) {
+                struct pollfd out = { fileno(stdout), POLLOUT, 0 };
+                if (poll(&out, 1, -1) >= 0 || errno == EINTR)
+                    continue;
+                break;
+            }
+            if (errno == EPIPE)
+                return;
+            break;
         }
+    }
 
-        ret = inflate(&strm, Z_NO_FLUSH);       /* normal inflate */
-
-        if (ret == Z_NEED_DICT)
-            ret = Z_DATA_ERROR;
-        if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
-            goto extract_ret;
-
-        fwrite(output, WINSIZE - strm.avail_out, 1, stdout);
-
-        /* if reach end of stream, then don't keep trying to get more */
-        if (ret == Z_STREAM_END)
+    buf = malloc(CAT_BLOCK);
+    while ((n = pread(fileno(log), buf, CAT_BLOCK, offset)) > 0) {
+        if (write_stdout(NULL, (unsigned char *) buf, n, offset))
             break;
+        offset += n;
     }
+    free(buf);
+}
 
-    /* clean up and return bytes read or error */
-  extract_ret:
-    (void) inflateEnd(&strm);
-    return ret;
+/* the framer only runs for ug_bisect() */
+void handle_request(request_t * req)
+{
+    ug_bisect_request(req);
 }
+
 /* 
  * ug_cat -- given a log file and (possibly) a file + (timestamp -> offset) index, cat the file starting 
- *           from about that timestamp 
+ *           from about that timestamp, and up to about the end timestamp if there is one
  */
 
-#define USAGE "Usage: ug_cat file timestamp\n"
+#define USAGE "Usage: ug_cat [-l framer] file timestamp [end_timestamp]\n\n" \
+              "  -l framer  the log's lua framer (or json[:field]): a plain log without an index is\n" \
+              "             bisected for the timestamp by the times of the requests it finds\n"
 
 int main(int argc, char **argv)
 {
-    int nread;
+    extern int optind;
     FILE *log;
     FILE *index;
-    char *log_fname, *index_fname, buf[4096];
+    char *log_fname, *index_fname, *framer = NULL;
+    off_t offset = 0;
+    lua_State *lua;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        if (opt != 'l') {
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+        framer = optarg;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
 
     if (argc < 3) {
         fprintf(stderr, USAGE);
@@ -161,6 +131,14 @@ int main(int argc, char **argv)
     index_fname = ug_get_index_fname(log_fname, "idx");
 
     index = fopen(index_fname, "r");
+    if (index) {
+        offset = ug_get_offset_for_timestamp(index, atol(argv[2]));
+        if (argc > 3) {
+            rewind(index);
+            end_offset = ug_get_end_offset_for_timestamp(index, atol(argv[3]));
+        }
+    }
+
     if (strcmp(log_fname + (strlen(log_fname) - 3), ".gz") == 0) {
         char *gzidx_fname;
         FILE *gzidx;
@@ -172,17 +150,18 @@ int main(int argc, char **argv)
                 perror("error opening gzidx component");
                 exit(1);
             }
-            ug_gzip_cat(log, atol(argv[2]), index, gzidx);
+            ug_gzip_cat(log, offset, gzidx, write_stdout, NULL);
 
         } else {
-            ug_gzip_cat(log, atol(argv[2]), NULL, NULL);
+            ug_gzip_cat(log, 0, NULL, write_stdout, NULL);
 
         }
     } else {
-        if (index)
-            fseeko(log, ug_get_offset_for_timestamp(index, atol(argv[2])), SEEK_SET);
-
-        while ((nread = fread(buf, 1, 4096, log)))
-            fwrite(buf, 1, nread, stdout);
+        if (!index && framer) {
+            if (!(lua = ug_lua_init(framer)))
+                exit(1);
+            offset = ug_bisect(log, lua, atol(argv[2]));
+        }
+        cat_plain(log, offset);
     }
 }
@@ -4,29 +4,295 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <lua.h>
+#include "zlib.h"
 #include "pcre.h"
 #include "request.h"
 #include "ug_lua.h"
+#include "ug_index.h"
+#include "ug_gzip.h"
+#include "ug_cache.h"
+#include "ug_literal.h"
+#include "ug_buffer.h"
+#include "ug_utf8.h"
+#include "ug_meta.h"
+#include "ug_json.h"
+#include "ug_prefetch.h"
+#include "ug_bisect.h"
 
 struct ug_regexp {
   int invert;
   pcre *re;
+  char *arg;
+  int literal;              /* its pattern in ctx.literals, or -1 if pcre has to run it */
 };
 
+struct ug_regexp_stats {
+  unsigned long tested;     /* how often it ran, how often it threw the request out */
+  unsigned long rejected;
+  unsigned long timed;      /* the runs we timed, see TIME_EVERY, and how long they took */
+  double seconds;
+  unsigned long limited;    /* requests it ran out of backtracking on, see -L */
+};
+
+#define MAX_THREADS 64
+#define MAX_FIELDS 32
+
+/* re-rank the regexps after this many requests */
+#define REORDER_INTERVAL 1024
+/* and time the regexps on one request in this many; a clock read per regexp per request adds up */
+#define TIME_EVERY 64
+
+/*
+ * a request that's still going after UG_STREAM_BYTES stops being held in the
+ * read buffer: it's matched a stretch at a time as it goes by, and spooled to
+ * a temporary file in case it matches (see stream_request()).  what's left
+ * behind each stretch is UG_STREAM_OVERLAP bytes, or back to the start of a
+ * partial pcre match, but never more than UG_STREAM_CARRY.
+ */
+#define UG_STREAM_BYTES (16 * 1024 * 1024)
+#define UG_STREAM_OVERLAP 65536
+#define UG_STREAM_CARRY (1024 * 1024)
+/* how much of a streamed request -k and -W get to see */
+#define UG_STREAM_HEAD 65536
+/* longer lines reach the framer in pieces */
+#define UG_MAX_LINE (1024 * 1024)
+
 typedef struct {
     time_t start_time;
     time_t end_time;
     int num_regexps;
     struct ug_regexp *regexps;
+    ug_literal_t *literals;     /* the plain-text regexps, when there's more than one */
+    int stats;
+    int utf8;
+    char **regexp_args;
     char *lua_file;
     char *in_file;
+    char *prefetch;             /* the log we'll probably be asked to search next */
+    int drop_cache;             /* -D: leave the log out of the page cache once it's read */
+    double sample_rate;         /* -r: the share of index blocks to count matches in */
+    int reverse;                /* -R: newest first, a block at a time from the end of the range */
+    int index_on_read;          /* -I: write the index of a log that doesn't have one as we search it */
+    FILE *new_index;            /* the index being written, under a temporary name until it's done */
+    FILE *new_gz_index;
+    char *new_index_fname;
+    char *new_gz_index_fname;
+    time_t last_index_time;
+    int use_cache;
+    ug_cache_t *cache;
+    int worker;
+    int threads;
+    unsigned long max_count;    /* stop after this many matches, 0 for no limit */
+    unsigned long match_limit;  /* -L: what one regexp may spend on one request, 0 for pcre's own limit */
+    int abort_on_limit;         /* -A: running out of it stops the search instead of leaving the request out */
+    pcre_extra limits;
+    int num_fields;             /* -F name=regexp, for -W to test */
+    char *field_names[MAX_FIELDS];
+    char *field_args[MAX_FIELDS];
+    pcre *field_res[MAX_FIELDS];
+    int num_preds;
+    ug_meta_pred_t preds[MAX_FIELDS];
+    int prefiltered;            /* the requests coming in already passed the -W tests */
+    int num_keys;               /* -k tests on JSON records */
+    ug_meta_pred_t keys[MAX_FIELDS];
+    lua_State *luas[MAX_THREADS];   /* luas[0] is the one main() set up */
 } context_t;
 
 static context_t ctx;
 
-static const char* commandparams="l:s:e:k:f:";
-static const char* usage ="Usage: ug_guts [-f input] -l file.lua -s start_time -e end_time regexps [... regexps]\n\n";
+/* -R: a match written to the spool, to be printed once its block is done */
+typedef struct {
+    time_t time;
+    off_t pos;
+    size_t length;
+} ug_spooled_t;
+
+/*
+ * what a scan of the log -- or with -j, of one stretch of it -- keeps to
+ * itself: the read buffer, how far it got in time, where its output goes
+ * and how the regexps have done on its requests.
+ */
+typedef struct {
+    ug_buffer_t rbuf;
+    time_t max_request_time;
+    off_t start;
+    off_t end;                  /* stop at the line that starts here, -1 to read to the end */
+    int stopped;                /* got to end, past the end of the time range or to -m matches */
+    unsigned long matched;
+    FILE *file;
+    FILE *out;
+    lua_State *lua;
+    pthread_t thread;
+
+    int *order;
+    struct ug_regexp_stats *stats;
+    unsigned long checked;
+    unsigned char *found;
+
+    int probing;                /* just looking for where a request starts, see find_boundary() */
+    int probed;
+    off_t boundary;
+    time_t boundary_time;       /* the time of the last request before it that has one */
+
+    ug_spooled_t *spooled;      /* -R: the current block's matches, out is the spool */
+    size_t num_spooled;
+    size_t spooled_allocated;
+
+    off_t stream_start;         /* the request being streamed starts here, or -1 if there isn't one */
+    off_t streamed;             /* it's been spooled up to here */
+    FILE *stream_spool;
+    char *stream_head;          /* its first UG_STREAM_HEAD bytes */
+    size_t stream_head_len;
+    unsigned char *stream_matched;  /* per regexp: matched somewhere in it so far (2: ran out of -L) */
+    off_t *stream_resume;       /* per regexp: where pcre picks up, at the start of a partial match */
+    unsigned char *stream_literals;
+} scan_t;
+
+static scan_t main_scan;
+static __thread scan_t *scan = &main_scan;
+
+static const char* commandparams="l:s:e:k:f:cwSuj:m:F:W:P:Dr:RIL:A";
+static const char* usage ="Usage: ug_guts [-f input [-c]] -l file.lua -s start_time -e end_time regexps [... regexps]\n"
+                          "       ug_guts -w -l file.lua\n\n"
+                          "  -l json[:field]  frame JSON lines, one request each, timed by their \"time\" (or field)\n"
+                          "            value -- instead of a lua framer\n"
+                          "  -f input  read the log file (plain or gzipped) directly, seeking with its index\n"
+                          "  -j n      search a plain log with n threads, each taking a stretch of it (needs -f)\n"
+                          "  -c        cache matches next to the index, and answer from earlier results (needs -f)\n"
+                          "  -m n      stop after n matching requests -- the first n in time, as the log is in order\n"
+                          "  -F name=regexp  a field of each request: the regexp's first group, or all it matched\n"
+                          "  -W test   only requests whose field passes, as in status=500 or duration>=2000 (=, !=,\n"
+                          "            <, <=, >, >=; numbers compare as numbers).  with -f, the log's .meta sidecar\n"
+                          "            (see ug_build_index -F) answers it without reading the other requests\n"
+                          "  -k test   only JSON records that pass, as in account_id=1 or user.name!=bob (same\n"
+                          "            operators as -W; nested objects with dots)\n"
+                          "  -P log    start reading the next log to be searched into the page cache\n"
+                          "  -D        drop the log from the page cache as it's read, for archives nobody else\n"
+                          "            is reading (needs -f)\n"
+                          "  -r rate   estimate instead of search: count the matches in about this share (0-1) of the\n"
+                          "            stretches between index entries (picked by a hash of where they start), and\n"
+                          "            print only \"@@sample <blocks> <sampled> <sum of counts> <sum of squares>\".\n"
+                          "            not with -m\n"
+                          "  -I        a log without an index gets one as it's searched, the way ug_build_index\n"
+                          "            would write it (a gzipped one is read to the end for it)\n"
+                          "  -R        newest first: with -f and an index, the blocks between index entries from\n"
+                          "            the end of the range back, so -m stops after the last n matches\n"
+                          "  -L steps  a regexp gets this many backtracking steps (pcre's match limit) on a request.\n"
+                          "            a request one runs out on is left out, and counted in a\n"
+                          "            \"@@limited <regexp> <requests>\" line after the search (regexps count from 0)\n"
+                          "  -A        stop the search at the first request a regexp runs out on\n"
+                          "  -u        leave bytes that aren't valid UTF-8 out of the output\n"
+                          "  -S        print how often each regexp was tested, rejected and what it cost to stderr\n"
+                          "  -w        worker mode: read searches from stdin, one per line, as tab-separated\n"
+                          "            arguments (-f input -s start_time -e end_time [-c] regexps ...).\n"
+                          "            each search's output ends with a \"@@done\" line.\n\n";
+
+/* in worker mode the same regexps come back search after search; compile each one once */
+typedef struct compiled_regexp {
+    char *pattern;
+    pcre *re;
+    struct compiled_regexp *next;
+} compiled_regexp_t;
+
+static compiled_regexp_t *compiled_regexps;
+
+pcre *compile_regexp(char *pattern, const char **error, int *erroffset)
+{
+    compiled_regexp_t *c;
+
+    for (c = compiled_regexps; c; c = c->next) {
+        if ( strcmp(c->pattern, pattern) == 0 )
+            return c->re;
+    }
+
+    c = malloc(sizeof(compiled_regexp_t));
+    c->re = pcre_compile(pattern, 0, error, erroffset, NULL);
+    if ( !c->re ) {
+        free(c);
+        return NULL;
+    }
+    c->pattern = strdup(pattern);
+    c->next = compiled_regexps;
+    compiled_regexps = c;
+    return c->re;
+}
+
+/* the text a regexp stands for, if it's plain text; the caller frees it */
+char *regexp_literal(struct ug_regexp *r, size_t *len)
+{
+    char *pattern = r->arg, *literal;
+
+    if ( pattern[0] == '!' || pattern[0] == '+' )
+        pattern++;
+
+    literal = malloc(strlen(pattern) + 1);
+    if ( !ug_literal_parse(pattern, literal, len) ) {
+        free(literal);
+        return NULL;
+    }
+    return literal;
+}
+
+/* with two or more plain-text regexps, one automaton pass beats a pcre_exec per regexp */
+void find_literals()
+{
+    char *literal;
+    size_t len;
+    int i, n = 0;
+
+    for (i = 0; i < ctx.num_regexps; i++) {
+        if ( (literal = regexp_literal(&ctx.regexps[i], &len)) )
+            n++;
+        free(literal);
+    }
+    if ( n < 2 )
+        return;
+
+    ctx.literals = ug_literal_new();
+    for (i = 0; i < ctx.num_regexps; i++) {
+        if ( (literal = regexp_literal(&ctx.regexps[i], &len)) )
+            ctx.regexps[i].literal = ug_literal_add(ctx.literals, literal, len);
+        free(literal);
+    }
+    ug_literal_compile(ctx.literals);
+}
+
+int field_index(char *name)
+{
+    int i;
+
+    for (i = 0; i < ctx.num_fields; i++) {
+        if ( strcmp(ctx.field_names[i], name) == 0 )
+            return i;
+    }
+    return -1;
+}
+
+/* -F name=regexp */
+int add_field(char *arg)
+{
+    char *eq;
+    const char *error;
+    int erroffset;
+
+    eq = strchr(arg, '=');
+    if ( !eq || eq == arg || ctx.num_fields == MAX_FIELDS )
+        return -1;
+
+    ctx.field_res[ctx.num_fields] = compile_regexp(eq + 1, &error, &erroffset);
+    if ( !ctx.field_res[ctx.num_fields] ) {
+        fprintf(stderr, "Error compiling regexp \"%s\": %s\n", eq + 1, error);
+        return -1;
+    }
+    ctx.field_args[ctx.num_fields] = strdup(arg);
+    ctx.field_names[ctx.num_fields++] = strndup(arg, eq - arg);
+    return 0;
+}
 
 int parse_args(int argc, char **argv)
 {
@@ -36,7 +302,6 @@ int parse_args(int argc, char **argv)
     int erroffset, optValue=0, retValue=1, i;
     ctx.start_time = -1;
     ctx.end_time = -1;
-    ctx.lua_file = NULL;
 
     while ((optValue = getopt(argc, argv, commandparams))!= -1) {
         switch (optValue) {
@@ -52,6 +317,65 @@ int parse_args(int argc, char **argv)
             case 'e':
                 ctx.end_time = atol(optarg);
                 break;
+            case 'c':
+                ctx.use_cache = 1;
+                break;
+            case 'w':
+                ctx.worker = 1;
+                break;
+            case 'S':
+                ctx.stats = 1;
+                break;
+            case 'u':
+                ctx.utf8 = 1;
+                break;
+            case 'j':
+                ctx.threads = atoi(optarg);
+                if ( ctx.threads < 1 || ctx.threads > MAX_THREADS )
+                    return(-1);
+                break;
+            case 'm':
+                ctx.max_count = atol(optarg);
+                break;
+            case 'F':
+                if ( add_field(optarg) == -1 )
+                    return(-1);
+                break;
+            case 'r':
+                ctx.sample_rate = atof(optarg);
+                if ( ctx.sample_rate <= 0 || ctx.sample_rate > 1 )
+                    return(-1);
+                break;
+            case 'R':
+                ctx.reverse = 1;
+                break;
+            case 'I':
+                ctx.index_on_read = 1;
+                break;
+            case 'L':
+                ctx.match_limit = atol(optarg);
+                if ( !ctx.match_limit )
+                    return(-1);
+                break;
+            case 'A':
+                ctx.abort_on_limit = 1;
+                break;
+            case 'D':
+                ctx.drop_cache = 1;
+                break;
+            case 'P':
+                ctx.prefetch = strdup(optarg);
+                break;
+            case 'k':
+                if ( ctx.num_keys == MAX_FIELDS || ug_meta_parse_pred(optarg, &ctx.keys[ctx.num_keys]) == -1 )
+                    return(-1);
+                ctx.num_keys++;
+                break;
+            case 'W':
+                if ( ctx.num_preds == MAX_FIELDS || ug_meta_parse_pred(optarg, &ctx.preds[ctx.num_preds]) == -1 )
+                    return(-1);
+                ctx.num_preds++;
+                break;
             case '?':
                 return(-1);
                 break;
@@ -61,57 +385,323 @@ int parse_args(int argc, char **argv)
                 return(-1);
             }
     }
-    if ( ctx.lua_file == NULL ||  ctx.start_time < 0 || ctx.end_time < 0 ) {	// mandatory fields
+    if ( ctx.worker && optind == argc ) {   // a worker gets its searches on stdin
+        return ctx.lua_file ? retValue : -1;
+    }
+    else if ( ctx.lua_file == NULL ||  ctx.start_time < 0 || ctx.end_time < 0 ) {	// mandatory fields
         return(-1);
     }
     else if ((optind + 1 ) > argc) { // Need at least one argument after options
         return(-1);
     }
+    else if ( ctx.use_cache && !ctx.in_file ) { // offsets in a pipe don't mean anything next time
+        return(-1);
+    }
+    else if ( ctx.sample_rate && ctx.max_count ) { // a sample has to be counted all the way through
+        return(-1);
+    }
+
+    if ( ctx.match_limit ) {
+        ctx.limits.flags = PCRE_EXTRA_MATCH_LIMIT;
+        ctx.limits.match_limit = ctx.match_limit;
+    }
+
+    for (i = 0; i < ctx.num_preds; i++) {
+        ctx.preds[i].field = field_index(ctx.preds[i].name);
+        if ( ctx.preds[i].field < 0 ) {
+            fprintf(stderr, "No -F field named \"%s\"\n", ctx.preds[i].name);
+            return(-1);
+        }
+    }
 
     if (optind < argc) {	// regexps follow after command-line options
         ctx.num_regexps = argc - optind;
+        ctx.regexp_args = argv + optind;
         ctx.regexps = malloc(sizeof(struct ug_regexp) * ctx.num_regexps);
         bzero(ctx.regexps, sizeof(struct ug_regexp) * ctx.num_regexps);
 
         for (i=0; optind < argc; ++optind, i++) {
             char *p = argv[optind];
+            ctx.regexps[i].arg = p;
+            ctx.regexps[i].literal = -1;
             if ( p[0] == '!' || p[0] == '+' ) {
                 ctx.regexps[i].invert = p[0] == '!';
                 p++;
             }
 
-            ctx.regexps[i].re = pcre_compile(p, 0, &error, &erroffset, NULL);
-            if (error) {
+            ctx.regexps[i].re = compile_regexp(p, &error, &erroffset);
+            if (!ctx.regexps[i].re) {
                 fprintf(stderr, "Error compiling regexp \"%s\": %s\n", argv[optind], error);
+                if ( ctx.worker )
+                    return(-1);
                 exit(1);
             }
          }
+
+        find_literals();
     }
     return retValue;
 }
 
-int check_request(char *request, struct ug_regexp *regexps, int num_regexps)
+/*
+ * what it costs, on average, to get a request thrown out by this regexp:
+ * what one run costs (from the runs we timed) over how often a run throws
+ * one out.  regexps that haven't been timed yet go first, so we learn
+ * something about them; ones that never threw anything out go last.
+ */
+double regexp_rank(struct ug_regexp_stats *r)
+{
+    double cost;
+
+    if ( !r->timed )
+        return 0;
+    cost = r->seconds / r->timed;
+    if ( !r->rejected )
+        return 1e30 + cost;
+    return cost * r->tested / r->rejected;
+}
+
+int compare_rank(const void *a, const void *b)
+{
+    double ra = regexp_rank(&scan->stats[*(int *) a]), rb = regexp_rank(&scan->stats[*(int *) b]);
+    return ra < rb ? -1 : ra > rb;
+}
+
+/* the -L budget for pcre_exec() */
+pcre_extra *match_limits()
+{
+    return ctx.match_limit ? &ctx.limits : NULL;
+}
+
+int out_of_backtracking(int rc)
+{
+    return rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT;
+}
+
+/*
+ * a regexp ran out of backtracking on a request.  whatever the pattern, we
+ * can't say whether it matched: the request is left out, and counted.
+ */
+void over_limit(struct ug_regexp_stats *stats)
 {
-  int j, matched, ovector[30];
+    stats->limited++;
+    if ( ctx.abort_on_limit )
+        scan->stopped = 1;
+}
+
+/*
+ * a request has to get past every regexp, so the order they run in doesn't
+ * change the answer -- only how quickly we get to it.  run the cheap, picky
+ * ones first.
+ */
+int check_request(char *request, size_t length)
+{
+  int j, matched, ovector[30], scanned = 0, timing;
+  struct timespec t0, t1;
+  struct ug_regexp *r;
+  struct ug_regexp_stats *stats;
+
+  if ( ++scan->checked % REORDER_INTERVAL == 0 )
+    qsort(scan->order, ctx.num_regexps, sizeof(int), compare_rank);
+  timing = scan->checked % TIME_EVERY == 1;
+
+  for (j = 0; j < ctx.num_regexps; j++) {
+    r = &ctx.regexps[scan->order[j]];
+    stats = &scan->stats[scan->order[j]];
+    if ( timing )
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ( r->literal >= 0 ) {
+        /* the first plain-text regexp to run looks for all of them */
+        if ( !scanned++ )
+            ug_literal_scan(ctx.literals, request, length, scan->found);
+        matched = scan->found[r->literal] ? 0 : -1;
+    } else {
+        matched = pcre_exec(r->re, match_limits(), request, length, 0, 0, ovector, 30);
+    }
+    if ( timing ) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        stats->timed++;
+        stats->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    }
 
-  for (j = 0; j < num_regexps; j++) {
-    matched = pcre_exec(regexps[j].re, NULL, request, strlen(request), 0, 0, ovector, 30);
-    if ( matched < 0 && !regexps[j].invert )
+    stats->tested++;
+    if ( out_of_backtracking(matched) ) {
+        over_limit(stats);
         return 0;
-    else if ( matched >= 0 && regexps[j].invert )
+    }
+    if ( (matched < 0) != r->invert ) {
+        stats->rejected++;
         return 0;
+    }
   }
 
   return 1;
 }
 
-void print_request(char *request)
+/* the -W tests, on the fields as -F finds them in the request's text */
+int check_fields(char *request, size_t length)
 {
-    int i, last_line_len = 0;
-    char *p;
+    ug_meta_pred_t *pred;
+    int i, rc, ovector[30];
+
+    for (i = 0; i < ctx.num_preds; i++) {
+        pred = &ctx.preds[i];
+        rc = pcre_exec(ctx.field_res[pred->field], match_limits(), request, length, 0, 0, ovector, 30);
+        if ( rc >= 2 && ovector[2] >= 0 ) {
+            if ( !ug_meta_test(pred, request + ovector[2], ovector[3] - ovector[2]) )
+                return 0;
+        } else if ( rc >= 0 ) {
+            if ( !ug_meta_test(pred, request + ovector[0], ovector[1] - ovector[0]) )
+                return 0;
+        } else if ( !ug_meta_test(pred, "", 0) ) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    printf("%s", request);
-    p = request + (strlen(request) - 1);
+/* the -k tests, straight off the JSON text; a missing key is an empty value */
+int check_keys(char *request, size_t length)
+{
+    const char *value;
+    size_t len;
+    int i;
+
+    for (i = 0; i < ctx.num_keys; i++) {
+        if ( !ug_json_find(request, length, ctx.keys[i].name, &value, &len) ) {
+            value = "";
+            len = 0;
+        }
+        if ( !ug_meta_test(&ctx.keys[i], (char *) value, len) )
+            return 0;
+    }
+    return 1;
+}
+
+/* with -j, the counts are added up over the threads, in the order the first one ended up with */
+void print_stats(char *name, scan_t *scans, int n)
+{
+    struct ug_regexp *r;
+    struct ug_regexp_stats total;
+    unsigned long checked = 0;
+    int i, j, k;
+
+    for (i = 0; i < n; i++)
+        checked += scans[i].checked;
+
+    fprintf(stderr, "ug_guts: %s: %lu requests checked, regexps in the order they ran last:\n",
+            name, checked);
+    for (j = 0; j < ctx.num_regexps; j++) {
+        k = scans[0].order[j];
+        r = &ctx.regexps[k];
+        bzero(&total, sizeof(total));
+        for (i = 0; i < n; i++) {
+            total.tested += scans[i].stats[k].tested;
+            total.rejected += scans[i].stats[k].rejected;
+            total.timed += scans[i].stats[k].timed;
+            total.seconds += scans[i].stats[k].seconds;
+            total.limited += scans[i].stats[k].limited;
+        }
+        fprintf(stderr, "  %-30s %10lu tested %10lu rejected %10.2fus avg%s", r->arg, total.tested, total.rejected,
+                total.timed ? total.seconds * 1e6 / total.timed : 0, r->literal >= 0 ? " (literal)" : "");
+        if ( total.limited )
+            fprintf(stderr, " %lu over the match limit", total.limited);
+        fputc('\n', stderr);
+    }
+}
+
+/* for the driver: the requests each regexp ran out of backtracking on, added up over the threads */
+void print_limits(scan_t *scans, int n)
+{
+    unsigned long limited;
+    int i, j;
+
+    for (j = 0; j < ctx.num_regexps; j++) {
+        for (i = 0, limited = 0; i < n; i++)
+            limited += scans[i].stats[j].limited;
+        if ( limited )
+            printf("@@limited %d %lu\n", j, limited);
+    }
+    fflush(stdout);
+}
+
+/* whether the scan left out any request for running out of backtracking */
+int hit_limit(scan_t *s)
+{
+    int j;
+
+    for (j = 0; j < ctx.num_regexps; j++)
+        if ( s->stats[j].limited )
+            return 1;
+    return 0;
+}
+
+/* a fresh scan, reading from file (if any) and printing to out */
+void init_scan(scan_t *s, lua_State *lua, FILE *file, FILE *out)
+{
+    int i;
+
+    ug_buffer_reset(&s->rbuf, 0);
+    s->max_request_time = 0;
+    s->start = 0;
+    s->end = -1;
+    s->stopped = 0;
+    s->matched = 0;
+    s->lua = lua;
+    s->file = file;
+    s->out = out;
+    s->probing = s->probed = 0;
+    s->rbuf.drop_behind = ctx.drop_cache;
+    s->rbuf.max_line = UG_MAX_LINE;
+    s->stream_start = -1;
+
+    s->order = malloc(sizeof(int) * ctx.num_regexps);
+    for (i = 0; i < ctx.num_regexps; i++)
+        s->order[i] = i;
+    s->stats = calloc(ctx.num_regexps, sizeof(struct ug_regexp_stats));
+    s->checked = 0;
+    s->found = ctx.literals ? malloc(ctx.literals->num_patterns) : NULL;
+    s->stream_matched = malloc(ctx.num_regexps);
+    s->stream_resume = malloc(sizeof(off_t) * ctx.num_regexps);
+    s->stream_literals = ctx.literals ? malloc(ctx.literals->num_patterns) : NULL;
+}
+
+/* start reading again at offset, forgetting whatever was being streamed */
+void rewind_scan(scan_t *s, off_t offset)
+{
+    ug_buffer_reset(&s->rbuf, offset);
+    s->stream_start = -1;
+}
+
+/* keeps the read buffer for the next search */
+void free_scan(scan_t *s)
+{
+    free(s->order);
+    free(s->stats);
+    free(s->found);
+    s->order = NULL;
+    s->stats = NULL;
+    s->found = NULL;
+    free(s->spooled);
+    s->spooled = NULL;
+    s->num_spooled = s->spooled_allocated = 0;
+    free(s->stream_matched);
+    free(s->stream_resume);
+    free(s->stream_literals);
+    free(s->stream_head);
+    s->stream_matched = s->stream_literals = NULL;
+    s->stream_resume = NULL;
+    s->stream_head = NULL;
+    if ( s->stream_spool )
+        fclose(s->stream_spool);
+    s->stream_spool = NULL;
+}
+
+/* the dashes under a request, as long as its last line (up to 80); request may be just its tail */
+void print_separator(char *request, size_t length)
+{
+    int i, last_line_len = 0;
+    char *p = request + (length - 1);
 
     /* skip trailing newlines */
     while ( p > request && (*p == '\n') )
@@ -123,50 +713,1289 @@ void print_request(char *request)
     }
 
     for (i = 0; i < (last_line_len - 1) && i < 80; i++)
-        putchar('-');
+        putc('-', scan->out);
 
-    putchar('\n');
-    fflush(stdout);
+    putc('\n', scan->out);
+}
+
+void print_request(char *request, size_t length)
+{
+    if ( !length )
+      return;
+
+    if ( ctx.utf8 )
+        ug_utf8_write(request, length, scan->out);
+    else
+        fwrite(request, length, 1, scan->out);
+    print_separator(request, length);
+    fflush(scan->out);
+}
+
+/* a streamed request, length bytes of its spool from offset on */
+void print_streamed(off_t offset, size_t length)
+{
+    char buf[65536];
+    size_t have = 0, left = length, n, out;
+
+    if ( !length )
+        return;
+
+    fseeko(scan->stream_spool, offset, SEEK_SET);
+    while ( left || have ) {
+        n = fread(buf + have, 1, left < sizeof(buf) - have ? left : sizeof(buf) - have, scan->stream_spool);
+        left = n ? left - n : 0;
+        have += n;
+
+        /* -u gets whole lines where it can, so it doesn't see a character cut in two */
+        out = have;
+        if ( ctx.utf8 && left ) {
+            while ( out > 0 && buf[out - 1] != '\n' )
+                out--;
+            if ( !out )
+                out = have;
+        }
+        if ( ctx.utf8 )
+            ug_utf8_write(buf, out, scan->out);
+        else
+            fwrite(buf, out, 1, scan->out);
+        memmove(buf, buf + out, have - out);
+        have -= out;
+    }
+
+    n = length < sizeof(buf) ? length : sizeof(buf);
+    fseeko(scan->stream_spool, offset + (off_t) (length - n), SEEK_SET);
+    if ( (n = fread(buf, 1, n, scan->stream_spool)) > 0 )
+        print_separator(buf, n);
+    fflush(scan->out);
+}
+
+/*
+ * match the request being streamed up to end, which with everything from
+ * rbuf.keep on is in the read buffer, and spool what's new.  until it's
+ * final, a pcre regexp that runs into the end of what we have may still
+ * match: it picks up again where that partial match started.
+ */
+void stream_match(off_t end, int final)
+{
+    ug_buffer_t *b = &scan->rbuf;
+    char *data = b->data + (b->keep - b->base);
+    size_t len = end > b->keep ? end - b->keep : 0, n;
+    off_t keep = end - UG_STREAM_OVERLAP;
+    struct ug_regexp *r;
+    int j, rc, ovector[30];
+
+    if ( end > scan->streamed ) {
+        n = end - scan->streamed;
+        fwrite(b->data + (scan->streamed - b->base), n, 1, scan->stream_spool);
+        if ( n > UG_STREAM_HEAD - scan->stream_head_len )
+            n = UG_STREAM_HEAD - scan->stream_head_len;
+        memcpy(scan->stream_head + scan->stream_head_len, b->data + (scan->streamed - b->base), n);
+        scan->stream_head_len += n;
+        scan->streamed = end;
+    }
+
+    if ( ctx.literals && len ) {
+        ug_literal_scan(ctx.literals, data, len, scan->found);
+        for (j = 0; j < ctx.literals->num_patterns; j++)
+            scan->stream_literals[j] |= scan->found[j];
+    }
+
+    for (j = 0; j < ctx.num_regexps; j++) {
+        r = &ctx.regexps[j];
+        if ( r->literal >= 0 || scan->stream_matched[j] )
+            continue;
+        if ( scan->stream_resume[j] < end ) {
+            rc = pcre_exec(r->re, match_limits(), data, len, scan->stream_resume[j] - b->keep,
+                           final ? 0 : PCRE_PARTIAL_HARD, ovector, 30);
+            /* 2: ran out of backtracking, which end_stream() counts */
+            if ( rc >= 0 || out_of_backtracking(rc) )
+                scan->stream_matched[j] = rc >= 0 ? 1 : 2;
+            scan->stream_resume[j] = rc == PCRE_ERROR_PARTIAL ? b->keep + ovector[0] : end;
+        }
+        if ( !scan->stream_matched[j] && scan->stream_resume[j] < keep )
+            keep = scan->stream_resume[j];
+    }
+
+    /* a partial match that's been going for longer than that isn't going to be held on to */
+    if ( keep < end - UG_STREAM_CARRY )
+        keep = end - UG_STREAM_CARRY;
+    if ( keep > b->keep )
+        b->keep = keep;
+    for (j = 0; j < ctx.num_regexps; j++)
+        if ( scan->stream_resume[j] < b->keep )
+            scan->stream_resume[j] = b->keep;
+}
+
+/*
+ * the request the framer has yet to report has grown past UG_STREAM_BYTES:
+ * from here on it's matched as it's read, and the read buffer only has to
+ * hold on to the overlap.  it can't be much use to a framer that hands its
+ * requests over as strings, but then that framer is holding it already.
+ */
+void stream_request()
+{
+    int j;
+
+    if ( scan->stream_start < 0 ) {
+        if ( !scan->stream_spool && !(scan->stream_spool = tmpfile()) ) {
+            perror("Couldn't spool a request");
+            exit(1);
+        }
+        rewind(scan->stream_spool);
+        if ( ftruncate(fileno(scan->stream_spool), 0) == -1 )
+            perror("Couldn't truncate the request spool");
+        if ( !scan->stream_head )
+            scan->stream_head = malloc(UG_STREAM_HEAD);
+        scan->stream_head_len = 0;
+        scan->stream_start = scan->streamed = scan->rbuf.keep;
+        memset(scan->stream_matched, 0, ctx.num_regexps);
+        for (j = 0; j < ctx.num_regexps; j++)
+            scan->stream_resume[j] = scan->stream_start;
+        if ( ctx.literals )
+            memset(scan->stream_literals, 0, ctx.literals->num_patterns);
+    }
+    stream_match(scan->rbuf.base + scan->rbuf.scanned, 0);
 }
 
+/*
+ * the framer's reported the request we've been streaming: match the rest of
+ * it, and check it the way handle_request() checks the others, -k and -W on
+ * its first UG_STREAM_HEAD bytes.  returns whether it passed.
+ */
+int end_stream(request_t *req)
+{
+    off_t end = req->offset + req->length;
+    size_t skip = req->offset - scan->stream_start, len;
+    struct ug_regexp *r;
+    int j, k, matched;
 
-time_t max_request_time = 0;
+    stream_match(end, 1);
+    scan->stream_start = -1;
+    if ( end > scan->rbuf.keep )
+        scan->rbuf.keep = end;
 
+    len = skip < scan->stream_head_len ? scan->stream_head_len - skip : 0;
+    if ( len > req->length )
+        len = req->length;
+    if ( ctx.num_keys && !check_keys(scan->stream_head + skip, len) )
+        return 0;
+
+    scan->checked++;
+    for (j = 0; j < ctx.num_regexps; j++) {
+        k = scan->order[j];
+        r = &ctx.regexps[k];
+        matched = r->literal >= 0 ? scan->stream_literals[r->literal] : scan->stream_matched[k];
+        scan->stats[k].tested++;
+        if ( matched == 2 ) {
+            over_limit(&scan->stats[k]);
+            return 0;
+        }
+        if ( (matched == 0) != r->invert ) {
+            scan->stats[k].rejected++;
+            return 0;
+        }
+    }
+
+    return ctx.prefiltered || check_fields(scan->stream_head + skip, len);
+}
+
+/* -I: an entry for the first request in every INDEX_EVERY seconds, like ug_build_index writes them */
+void index_request(request_t *req)
+{
+    time_t floored_time = req->time - (req->time % INDEX_EVERY);
+
+    if ( !ctx.last_index_time || floored_time > ctx.last_index_time ) {
+        ug_write_index(ctx.new_index, floored_time, req->offset);
+        ctx.last_index_time = floored_time;
+    }
+}
+
+void spool_match(time_t time, off_t pos, size_t length)
+{
+    if ( scan->num_spooled == scan->spooled_allocated ) {
+        scan->spooled_allocated = scan->spooled_allocated ? scan->spooled_allocated * 2 : 256;
+        scan->spooled = realloc(scan->spooled, sizeof(ug_spooled_t) * scan->spooled_allocated);
+    }
+    scan->spooled[scan->num_spooled].time = time;
+    scan->spooled[scan->num_spooled].pos = pos;
+    scan->spooled[scan->num_spooled].length = length;
+    scan->num_spooled++;
+}
+
+/*
+ * we read the input in large blocks and hand the framer one line at a time.
+ * the framer reports requests back as (offset, length) extents, which we find
+ * in the scan's buffer; rbuf.keep is moved up as requests are handled.
+ */
 void handle_request(request_t * req)
 {
+    off_t pos, spooled = -1;
+    int passed = 0;
+
+    if (ug_bisecting) {
+        ug_bisect_request(req);
+        return;
+    }
+    if (scan->probing) {
+        /* 2: looking back from the boundary for the last request before it with a time */
+        if (scan->probing == 2) {
+            if (req->offset >= scan->boundary)
+                scan->stopped = 1;
+            else if (req->time)
+                scan->boundary_time = req->time;
+        } else if (++scan->probed == 2) {
+            scan->boundary = req->offset;
+            scan->stopped = 1;
+        } else {
+            scan->boundary_time = req->time;
+        }
+        return;
+    }
+    if (req->buf) {
+        /* the framer held on to the request we were streaming itself: let the stream go */
+        if (scan->stream_start >= 0 && req->offset >= scan->stream_start)
+            scan->stream_start = -1;
+    } else {
+        ug_buffer_trim(&scan->rbuf, req);
+        if (scan->stream_start >= 0 && req->offset >= scan->stream_start) {
+            spooled = req->offset - scan->stream_start;
+            passed = end_stream(req);
+        }
+    }
+    if (spooled < 0 && !ug_buffer_resolve(&scan->rbuf, req))
+        return;
 
     if (!req->time)
-      req->time = max_request_time;
+      req->time = scan->max_request_time;
+
+    if (ctx.new_index)
+        index_request(req);
+
+    /* the framer's last request still comes in from on_eof(); -R keeps a block's last matches */
+    if (ctx.max_count && !ctx.reverse && scan->matched >= ctx.max_count)
+        return;
 
     if ((req->time >= ctx.start_time
           && req->time <= ctx.end_time
-          && check_request(req->buf, ctx.regexps, ctx.num_regexps))) {
-        if (req->time != 0) {
-            printf("@@%lu\n", req->time);
+          && (spooled >= 0 ? passed
+              : (!ctx.num_keys || check_keys(req->buf, req->length))
+                && check_request(req->buf, req->length)
+                && (ctx.prefiltered || check_fields(req->buf, req->length))))) {
+        scan->matched++;
+        /* -r only counts them */
+        if (!ctx.sample_rate) {
+            pos = ctx.reverse ? ftello(scan->out) : 0;
+            if (req->time != 0) {
+                fprintf(scan->out, "@@%lu\n", req->time);
+            }
+            if (spooled >= 0)
+                print_streamed(spooled, req->length);
+            else
+                print_request(req->buf, req->length);
+            if (ctx.reverse)
+                spool_match(req->time, pos, ftello(scan->out) - pos);
         }
-        print_request(req->buf);
+        if (ctx.cache)
+            ug_cache_add(ctx.cache, req);
+        if (ctx.max_count && !ctx.reverse && scan->matched >= ctx.max_count)
+            scan->stopped = 1;
     }
     /* print a time-marker every second -- allows collections of logs with one sparse
-       log to proceed */
-    if (req->time > max_request_time) {
-        max_request_time = req->time;
-        printf("@@%lu\n", max_request_time);
+       log to proceed.  going backwards, the matches are all there is to go by */
+    if (req->time > scan->max_request_time) {
+        scan->max_request_time = req->time;
+        if (!ctx.reverse)
+            fprintf(scan->out, "@@%lu\n", scan->max_request_time);
     }
 }
 
+/* hand complete lines to the framer; returns non-zero once we're past the end of the range */
+int frame_lines(lua_State *lua)
+{
+    char *line;
+    size_t len;
+    off_t offset;
 
+    /* indexing a gzipped log, we frame all of it: its index is no use unless it's whole */
+    while ( (!scan->stopped || ctx.new_gz_index) && (line = ug_buffer_next_line(&scan->rbuf, &len, &offset)) ) {
+        if ( scan->end >= 0 && offset >= scan->end ) {
+            scan->stopped = 1;
+            break;
+        }
+        ug_process_line(lua, line, len, offset);
+        if ( scan->rbuf.base + (off_t) scan->rbuf.scanned - scan->rbuf.keep > UG_STREAM_BYTES && !scan->probing )
+            stream_request();
+        if ( scan->max_request_time > ctx.end_time )
+            scan->stopped = 1;
+    }
+    return scan->stopped && !ctx.new_gz_index;
+}
 
-int main(int argc, char **argv)
+/* ug_output_fn for ug_gzip_cat() */
+int frame_output(void *arg, unsigned char *data, size_t len, off_t offset)
 {
-    lua_State *lua;
-    ssize_t line_size;
-    FILE *file = NULL;
-    char *line = NULL;
-    size_t allocated = 0, offset = 0;
-    if (argc < 5) {
-        fprintf(stderr, "%s", usage);
+    if ( scan->rbuf.len == 0 && scan->rbuf.base == 0 )
+        rewind_scan(scan, offset);
+
+    ug_buffer_append(&scan->rbuf, data, len);
+    return frame_lines((lua_State *) arg);
+}
+
+void frame_file(lua_State *lua, FILE *file)
+{
+    while ( ug_buffer_read(&scan->rbuf, file) > 0 ) {
+        if ( frame_lines(lua) )
+            return;
+    }
+}
+
+void frame_eof(lua_State *lua)
+{
+    char *line;
+    size_t len;
+    off_t offset;
+
+    /* hand over a trailing line without a newline */
+    if ( !scan->stopped && (line = ug_buffer_rest(&scan->rbuf, &len, &offset)) )
+        ug_process_line(lua, line, len, offset);
+    ug_lua_on_eof(lua);
+}
+
+int is_gzipped(char *fname)
+{
+    return strlen(fname) > 3 && strcmp(fname + (strlen(fname) - 3), ".gz") == 0;
+}
+
+/*
+ * the log's index, and for gzipped logs the access points to go with it -- the
+ * same lookup ug_cat does.  sets the (uncompressed) offset to start from, and
+ * returns 0, or 1 if there's no index.
+ */
+int open_indexes(char *log_fname, off_t *offset, FILE **gz_index)
+{
+    FILE *index;
+
+    *offset = 0;
+    *gz_index = NULL;
+    index = fopen(ug_get_index_fname(log_fname, "idx"), "r");
+    if ( !index )
+        return 1;
+
+    *offset = ug_get_offset_for_timestamp(index, ctx.start_time);
+    fclose(index);
+
+    if ( is_gzipped(log_fname) ) {
+        *gz_index = fopen(ug_get_index_fname(log_fname, "gzidx"), "r");
+        if ( !*gz_index ) {
+            perror("error opening gzidx component");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* collects the bytes of the cached requests out of the inflated stream */
+typedef struct {
+    ug_span_t *spans;
+    size_t num_spans;
+    size_t next;
+    char *buf;
+    size_t filled;
+    int can_seek;
+} span_reader_t;
+
+/* the distance at which re-seeking to an access point beats inflating our way there */
+#define SPAN_RESEEK_BYTES (8 * 1024 * 1024)
+
+void handle_cached_span(span_reader_t *r, char *buf)
+{
+    request_t req;
+
+    req.buf = buf;
+    req.length = r->spans[r->next].length;
+    req.offset = r->spans[r->next].offset;
+    req.time = r->spans[r->next].time;
+    handle_request(&req);
+    /* -m: we've got all we wanted, nothing after this one */
+    if ( scan->stopped )
+        r->num_spans = r->next + 1;
+}
+
+int collect_spans(void *arg, unsigned char *data, size_t len, off_t offset)
+{
+    span_reader_t *r = (span_reader_t *) arg;
+    ug_span_t *span;
+    off_t from, to;
+
+    while ( r->next < r->num_spans ) {
+        span = &r->spans[r->next];
+        if ( span->offset >= offset + len )
+            break;
+
+        from = span->offset + r->filled;
+        if ( from < offset )    /* shouldn't happen, we start before the span */
+            return 1;
+
+        to = span->offset + span->length < offset + len ? span->offset + span->length : offset + len;
+        memcpy(r->buf + r->filled, data + (from - offset), to - from);
+        r->filled += to - from;
+
+        if ( r->filled < span->length )
+            return 0;
+
+        handle_cached_span(r, r->buf);
+        r->next++;
+        r->filled = 0;
+        if ( r->next < r->num_spans && r->can_seek
+             && r->spans[r->next].offset > offset + len + SPAN_RESEEK_BYTES )
+            return 1;
+    }
+    return r->next == r->num_spans;
+}
+
+/* answer the query from the requests a previous search found */
+void read_cached_spans(FILE *log, FILE *gz_index, ug_span_t *spans, size_t num_spans)
+{
+    span_reader_t r;
+    size_t i, longest = 0;
+
+    bzero(&r, sizeof(span_reader_t));
+    r.spans = spans;
+    r.num_spans = num_spans;
+    r.can_seek = gz_index != NULL;
+
+    for (i = 0; i < num_spans; i++) {
+        if ( spans[i].length > longest )
+            longest = spans[i].length;
+    }
+    r.buf = malloc(longest + 1);
+
+    if ( is_gzipped(ctx.in_file) ) {
+        while ( r.next < r.num_spans ) {
+            size_t before = r.next;
+
+            r.filled = 0;
+            ug_gzip_cat(log, spans[r.next].offset, gz_index, collect_spans, &r);
+            if ( r.next == before )     /* the log doesn't have that request anymore */
+                break;
+        }
+    } else {
+        for (r.next = 0; r.next < num_spans; r.next++) {
+            if ( fseeko(log, spans[r.next].offset, SEEK_SET) == -1
+                 || fread(r.buf, 1, spans[r.next].length, log) != spans[r.next].length )
+                break;
+            handle_cached_span(&r, r.buf);
+        }
+    }
+    free(r.buf);
+}
+
+/* don't bother splitting a log into stretches smaller than this */
+#define MIN_RANGE_BYTES (16 * 1024 * 1024)
+/* how far past a cut we'll look for the start of a request */
+#define PROBE_BYTES (64 * 1024 * 1024)
+
+/* frame the log from..end the way find_boundary() asks to */
+void probe(scan_t *s, int how, off_t from, off_t end)
+{
+    ug_lua_reset(s->lua);
+    s->probing = how;
+    s->probed = 0;
+    s->stopped = 0;
+    s->end = end;
+    rewind_scan(s, from);
+    lseek(fileno(s->file), from, SEEK_SET);
+
+    scan = s;
+    frame_file(s->lua, s->file);
+    scan = &main_scan;
+
+    s->probing = 0;
+}
+
+/*
+ * without an index, we find where a request starts by framing the log for a
+ * bit from the cut on.  the first request the framer reports may be the tail
+ * end of one that started before the cut; the second one is whole.
+ *
+ * the stretch starting there needs the time a single scan would have had
+ * there, for the requests without one of their own.  the tail usually left
+ * its time behind the cut, so we look back for it (no further than floor),
+ * twice as far each time.
+ */
+off_t find_boundary(scan_t *s, off_t from, off_t floor)
+{
+    off_t back, start;
+
+    s->boundary = -1;
+    s->boundary_time = 0;
+    probe(s, 1, from, from + PROBE_BYTES);
+
+    start = from;
+    for (back = 65536; s->boundary >= 0 && !s->boundary_time && start > floor && back <= PROBE_BYTES; back *= 2) {
+        start = from - back > floor ? from - back : floor;
+        probe(s, 2, start, s->boundary + 1);
+    }
+    return s->boundary;
+}
+
+/*
+ * the first indexed request at or after each cut -- index entries always
+ * point at the start of one -- and the entry's time, which is as close as
+ * the index gets to that of the request before it
+ */
+off_t find_indexed_boundary(FILE *index, off_t from, time_t *time)
+{
+    struct ug_index entry;
+
+    while ( fread(&entry, sizeof(struct ug_index), 1, index) == 1 ) {
+        if ( (off_t) entry.offset >= from ) {
+            *time = entry.time;
+            return entry.offset;
+        }
+    }
+    return -1;
+}
+
+void *scan_range(void *arg)
+{
+    scan = (scan_t *) arg;
+    scan->stopped = 0;
+    ug_lua_reset(scan->lua);
+    /* ug_buffer_read() bypasses stdio, and fseeko() can skip the lseek() when it thinks it's already there */
+    lseek(fileno(scan->file), scan->start, SEEK_SET);
+    rewind_scan(scan, scan->start);
+    frame_file(scan->lua, scan->file);
+    frame_eof(scan->lua);
+    fflush(scan->out);
+    return NULL;
+}
+
+void copy_output(FILE *from, FILE *to)
+{
+    char buf[65536];
+    size_t n;
+
+    rewind(from);
+    while ( (n = fread(buf, 1, sizeof(buf), from)) > 0 )
+        fwrite(buf, 1, n, to);
+    fflush(to);
+}
+
+/*
+ * -j: cut a plain log into stretches that start at request boundaries, and
+ * frame and match each one on its own thread, with its own lua state.  the
+ * first stretch prints as it goes; the others are spooled to temp files and
+ * printed in order behind it.
+ */
+void search_in_threads(lua_State *lua, FILE *file, off_t offset)
+{
+    scan_t scans[MAX_THREADS];
+    off_t cut, off, size;
+    FILE *index;
+    struct stat st;
+    int n = 0, threads, i;
+
+    fstat(fileno(file), &st);
+    size = st.st_size;
+    threads = ctx.threads;
+    if ( (size - offset) / MIN_RANGE_BYTES + 1 < threads )
+        threads = (size - offset) / MIN_RANGE_BYTES + 1;
+
+    memset(scans, 0, sizeof(scans));
+    index = fopen(ug_get_index_fname(ctx.in_file, "idx"), "r");
+
+    for (i = 0; i < threads; i++) {
+        if ( i > 0 && !ctx.luas[i] && !(ctx.luas[i] = ug_lua_init(ctx.lua_file)) )
+            break;
+
+        init_scan(&scans[n], i ? ctx.luas[i] : lua, i ? fopen(ctx.in_file, "r") : file, i ? tmpfile() : stdout);
+        if ( !scans[n].file || !scans[n].out ) {
+            perror("Couldn't set up a thread");
+            exit(1);
+        }
+
+        cut = offset + (size - offset) / threads * i;
+        if ( i > 0 ) {
+            /* an index that's behind the log only gets us so far */
+            if ( !index || (off = find_indexed_boundary(index, cut, &scans[n].max_request_time)) < 0 ) {
+                off = find_boundary(&scans[n], cut, scans[n - 1].start);
+                scans[n].max_request_time = scans[n].boundary_time;
+            }
+            cut = off;
+            if ( cut <= scans[n - 1].start ) {
+                fclose(scans[n].file);
+                fclose(scans[n].out);
+                free_scan(&scans[n]);
+                free(scans[n].rbuf.data);
+                memset(&scans[n], 0, sizeof(scan_t));
+                continue;
+            }
+            scans[n - 1].end = cut;
+        }
+        scans[n].start = cut;
+        scans[n].end = -1;
+        n++;
+    }
+    if ( index )
+        fclose(index);
+
+    for (i = 1; i < n; i++)
+        pthread_create(&scans[i].thread, NULL, scan_range, &scans[i]);
+    scan_range(&scans[0]);
+    scan = &main_scan;
+
+    for (i = 1; i < n; i++) {
+        pthread_join(scans[i].thread, NULL);
+        /* a single scan would have stopped at the end of the time range, and never got to the rest */
+        if ( scans[i - 1].max_request_time <= ctx.end_time )
+            copy_output(scans[i].out, stdout);
+        else
+            scans[i].max_request_time = scans[i - 1].max_request_time;
+    }
+
+    if ( ctx.stats )
+        print_stats(ctx.in_file, scans, n);
+    print_limits(scans, n);
+
+    for (i = 0; i < n; i++) {
+        if ( i > 0 ) {
+            fclose(scans[i].file);
+            fclose(scans[i].out);
+        }
+        free(scans[i].rbuf.data);
+        free_scan(&scans[i]);
+    }
+}
+
+/*
+ * -W with a sidecar: the rows in the time range that pass the tests are all
+ * we read of the part of the log it covers.  returns -1 if the sidecar can't
+ * answer, 0 with the spans to read.
+ */
+int meta_spans(ug_meta_t *meta, ug_span_t **spans, size_t *num_spans)
+{
+    int fields[MAX_FIELDS], i, pass;
+    uint32_t row, rows;
+    size_t allocated = 0, len;
+    char *value;
+
+    for (i = 0; i < ctx.num_preds; i++) {
+        if ( (fields[i] = ug_meta_field(meta, ctx.field_args[ctx.preds[i].field])) < 0 )
+            return -1;
+    }
+
+    *spans = NULL;
+    *num_spans = 0;
+    while ( (rows = ug_meta_read_block(meta, ctx.start_time, ctx.end_time)) > 0 ) {
+        for (row = 0; row < rows; row++) {
+            if ( (time_t) meta->times[row] < ctx.start_time || (time_t) meta->times[row] > ctx.end_time )
+                continue;
+            for (i = 0, pass = 1; pass && i < ctx.num_preds; i++) {
+                value = ug_meta_value(meta, fields[i], row, &len);
+                pass = ug_meta_test(&ctx.preds[i], value, len);
+            }
+            if ( !pass )
+                continue;
+
+            if ( *num_spans == allocated ) {
+                allocated = allocated ? allocated * 2 : 1024;
+                *spans = realloc(*spans, sizeof(ug_span_t) * allocated);
+            }
+            (*spans)[*num_spans].time = meta->times[row];
+            (*spans)[*num_spans].offset = meta->offsets[row];
+            (*spans)[*num_spans].length = meta->lengths[row];
+            (*num_spans)++;
+        }
+    }
+    return 0;
+}
+
+/* the log's sidecar, if it's there and still describes the log */
+ug_meta_t *open_meta(FILE *file)
+{
+    ug_meta_t *meta;
+    struct stat st;
+
+    meta = ug_meta_open(ug_get_index_fname(ctx.in_file, "meta"), file);
+    if ( !meta )
+        return NULL;
+    if ( !is_gzipped(ctx.in_file) && (fstat(fileno(file), &st) == -1 || meta->covered > st.st_size) ) {
+        ug_meta_free(meta);
+        return NULL;
+    }
+    return meta;
+}
+
+/* blocks are picked by a hash of where they start, so the same query samples the same ones */
+int sample_block(off_t offset)
+{
+    uint64_t x = offset + 0x9e3779b97f4a7c15ULL;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return (double) x / 18446744073709551616.0 < ctx.sample_rate;
+}
+
+/* the .idx entries of ctx.in_file, NULL (and *num 0) without one */
+struct ug_index *read_index_entries(size_t *num)
+{
+    FILE *index;
+    struct ug_index *entries = NULL;
+    size_t allocated = 0;
+
+    *num = 0;
+    if ( !(index = fopen(ug_get_index_fname(ctx.in_file, "idx"), "r")) )
+        return NULL;
+    for (;;) {
+        if ( *num == allocated ) {
+            allocated = allocated ? allocated * 2 : 1024;
+            entries = realloc(entries, sizeof(struct ug_index) * allocated);
+        }
+        if ( fread(&entries[*num], sizeof(struct ug_index), 1, index) != 1 )
+            break;
+        (*num)++;
+    }
+    fclose(index);
+    return entries;
+}
+
+/*
+ * the entries whose blocks -- up to the next entry -- may hold requests in the
+ * time range: a block's requests are from its entry's time up to the next
+ * entry's (floored) time and then some.  returns how many went into in_range.
+ */
+size_t blocks_in_range(struct ug_index *entries, size_t num, size_t *in_range)
+{
+    size_t i, blocks = 0;
+
+    for (i = 0; i < num; i++) {
+        if ( (time_t) entries[i].time <= ctx.end_time
+             && (i + 1 == num || (time_t) entries[i + 1].time + INDEX_EVERY > ctx.start_time) )
+            in_range[blocks++] = i;
+    }
+    return blocks;
+}
+
+/*
+ * -R and -r on a gzipped log: each block would inflate the log from the
+ * access point before it all over again.  instead the access point's stretch
+ * is inflated once, into a spool the blocks in it are read from.  newest
+ * first, that's up to the end of the block; going forward, on to the next
+ * access point (or until, the end of the range, if that's sooner).
+ */
+typedef struct {
+    FILE *file;
+    off_t from;                 /* the uncompressed stretch it holds */
+    off_t to;
+    off_t until;                /* 0 newest first, else where the range ends (-1 for the end of the log) */
+} gz_spool_t;
+
+/* ug_output_fn for ug_gzip_cat(), filling the spool up to its end (-1 for the end of the log) */
+int spool_output(void *arg, unsigned char *data, size_t len, off_t offset)
+{
+    gz_spool_t *spool = arg;
+    int done = spool->to >= 0 && offset + (off_t) len >= spool->to;
+
+    if ( done )
+        len = spool->to - offset;
+    if ( len && fwrite(data, len, 1, spool->file) != 1 ) {
+        perror("Couldn't spool the gzipped log");
+        exit(1);
+    }
+    return done;
+}
+
+/* make sure the spool has from..to in it */
+void fill_gz_spool(gz_spool_t *spool, FILE *file, FILE *gz_index, off_t from, off_t to)
+{
+    unsigned char *dict;
+    off_t compressed_offset, access_point = 0, next;
+
+    if ( spool->file && from >= spool->from && to >= 0 && to <= spool->to )
+        return;
+
+    if ( !spool->file && !(spool->file = tmpfile()) ) {
+        perror("Couldn't spool the gzipped log");
         exit(1);
     }
+    rewind(spool->file);
+    if ( ftruncate(fileno(spool->file), 0) == -1 )
+        perror("Couldn't truncate the gzipped log's spool");
+
+    dict = malloc(WINSIZE);
+    if ( !gz_index || !fill_gz_info(from, gz_index, dict, &compressed_offset, &access_point) )
+        access_point = 0;
+    free(dict);
+
+    spool->from = access_point;
+    spool->to = to;
+    if ( spool->until && to >= 0 ) {
+        next = gz_index ? ug_gzip_next_access_point(gz_index, from) : -1;
+        if ( next < 0 || (spool->until > 0 && next > spool->until) )
+            next = spool->until;
+        if ( next < 0 || next > to )
+            spool->to = next;
+    }
+    ug_gzip_cat(file, access_point, gz_index, spool_output, spool);
+    fflush(spool->file);
+    if ( spool->to < 0 )
+        spool->to = access_point + ftello(spool->file);
+}
+
+/*
+ * frame the stretch of the log from one index entry to the next (to is -1 for
+ * the end), from the spool if there's one; returns the matches in it.  a plain
+ * log is read no further than the stretch goes.
+ */
+unsigned long count_block(lua_State *lua, FILE *file, FILE *gz_index, gz_spool_t *spool, off_t from, off_t to)
+{
+    unsigned long before = main_scan.matched;
+
+    ug_lua_reset(lua);
+    main_scan.stopped = 0;
+    main_scan.max_request_time = 0;
+    main_scan.end = to;
+    if ( spool ) {
+        fill_gz_spool(spool, file, gz_index, from, to);
+        lseek(fileno(spool->file), from - spool->from, SEEK_SET);
+        rewind_scan(&main_scan, from);
+        /* the spool's offsets aren't the log's: nothing to advise the kernel on */
+        main_scan.rbuf.advised = -1;
+        main_scan.rbuf.end = to;
+        frame_file(lua, spool->file);
+    } else if ( is_gzipped(ctx.in_file) ) {
+        rewind_scan(&main_scan, 0);
+        ug_gzip_cat(file, from, gz_index, frame_output, lua);
+    } else {
+        lseek(fileno(file), from, SEEK_SET);
+        rewind_scan(&main_scan, from);
+        main_scan.rbuf.end = to;
+        frame_file(lua, file);
+    }
+    frame_eof(lua);
+    return main_scan.matched - before;
+}
+
+void print_sample(unsigned long blocks, unsigned long sampled, double sum, double sumsq)
+{
+    printf("@@sample %lu %lu %.0f %.0f\n", blocks, sampled, sum, sumsq);
+    fflush(stdout);
+}
+
+/*
+ * -r: the stretches between index entries are what we sample.  prints how
+ * many of them the time range covers, how many we counted the matches in,
+ * and the sum and the sum of squares of those counts -- enough for the
+ * driver to estimate the total, and how far off that may be.
+ */
+void search_sample(lua_State *lua, FILE *file, FILE *gz_index)
+{
+    struct ug_index *entries;
+    size_t num, i, blocks, *in_range;
+    unsigned long sampled = 0, count;
+    double sum = 0, sumsq = 0;
+    gz_spool_t spool = { NULL, 0, 0, -1 };
+
+    if ( !(entries = read_index_entries(&num)) || !num ) {
+        /* nothing to sample by: count it all, as one block */
+        count = count_block(lua, file, gz_index, NULL, 0, -1);
+        print_sample(1, 1, count, (double) count * count);
+        free(entries);
+        return;
+    }
+
+    in_range = malloc(sizeof(size_t) * num);
+    blocks = blocks_in_range(entries, num, in_range);
+    if ( blocks && in_range[blocks - 1] + 1 < num )
+        spool.until = entries[in_range[blocks - 1] + 1].offset;
+
+    for (i = 0; i < blocks; i++) {
+        if ( !sample_block(entries[in_range[i]].offset) && !(i == blocks / 2 && !sampled) )
+            continue;
+        count = count_block(lua, file, gz_index, is_gzipped(ctx.in_file) ? &spool : NULL,
+                            entries[in_range[i]].offset,
+                            in_range[i] + 1 < num ? (off_t) entries[in_range[i] + 1].offset : -1);
+        sampled++;
+        sum += count;
+        sumsq += (double) count * count;
+    }
+    print_sample(blocks, sampled, sum, sumsq);
+    if ( spool.file )
+        fclose(spool.file);
+    free(in_range);
+    free(entries);
+}
+
+static int newest_first(const void *a, const void *b)
+{
+    const ug_spooled_t *x = a, *y = b;
+
+    if ( x->time != y->time )
+        return x->time < y->time ? 1 : -1;
+    return x->pos < y->pos ? 1 : -1;
+}
+
+/* -R: print what the block just framed spooled, newest first, up to -m in all; returns non-zero once there */
+int print_spooled(scan_t *s, FILE *to, unsigned long *printed)
+{
+    char buf[65536];
+    size_t i, left, n;
+
+    qsort(s->spooled, s->num_spooled, sizeof(ug_spooled_t), newest_first);
+    for (i = 0; i < s->num_spooled && !(ctx.max_count && *printed >= ctx.max_count); i++, (*printed)++) {
+        fseeko(s->out, s->spooled[i].pos, SEEK_SET);
+        for (left = s->spooled[i].length; left > 0; left -= n) {
+            if ( (n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), s->out)) == 0 )
+                break;
+            fwrite(buf, 1, n, to);
+        }
+    }
+    fflush(to);
+
+    /* the next block writes over this one's */
+    rewind(s->out);
+    s->num_spooled = 0;
+    return ctx.max_count && *printed >= ctx.max_count;
+}
+
+/*
+ * -R: frame the blocks between index entries from the last one in the time
+ * range back to the first, and print each one's matches newest first.  with
+ * -m, we're done as soon as that many are printed -- "the last 20 today"
+ * only reads the end of the day.  without an index it's all one block.
+ */
+void search_reverse(lua_State *lua, FILE *file, FILE *gz_index)
+{
+    struct ug_index *entries;
+    size_t num, i, blocks, *in_range;
+    unsigned long printed = 0;
+    FILE *out = main_scan.out;
+    gz_spool_t spool = { NULL, 0, 0, 0 };
+    off_t from, to;
+
+    if ( !(main_scan.out = tmpfile()) ) {
+        perror("Couldn't spool matches");
+        exit(1);
+    }
+
+    if ( !(entries = read_index_entries(&num)) || !num ) {
+        count_block(lua, file, gz_index, NULL, 0, -1);
+        print_spooled(&main_scan, out, &printed);
+    } else {
+        in_range = malloc(sizeof(size_t) * num);
+        blocks = blocks_in_range(entries, num, in_range);
+        for (i = blocks; i > 0; i--) {
+            from = entries[in_range[i - 1]].offset;
+            to = in_range[i - 1] + 1 < num ? (off_t) entries[in_range[i - 1] + 1].offset : -1;
+            /* the block before is next: the kernel can be reading it while we match this one */
+            if ( i > 1 && !is_gzipped(ctx.in_file) )
+                posix_fadvise(fileno(file), entries[in_range[i - 2]].offset,
+                              from - (off_t) entries[in_range[i - 2]].offset, POSIX_FADV_WILLNEED);
+            count_block(lua, file, gz_index, is_gzipped(ctx.in_file) ? &spool : NULL, from, to);
+            if ( print_spooled(&main_scan, out, &printed) )
+                break;
+        }
+        free(in_range);
+    }
+
+    if ( spool.file )
+        fclose(spool.file);
+    free(entries);
+    fclose(main_scan.out);
+    main_scan.out = out;
+}
+
+/* a search killed halfway (by -m in the driver, say) leaves no half-written index behind */
+static void abandon_index(int sig)
+{
+    if ( ctx.new_index_fname )
+        unlink(ctx.new_index_fname);
+    if ( ctx.new_gz_index_fname )
+        unlink(ctx.new_gz_index_fname);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* the index file fname is written under until it's done */
+char *temporary_fname(char *fname)
+{
+    char *tmp = malloc(strlen(fname) + 32);
+
+    sprintf(tmp, "%s.%d", fname, (int) getpid());
+    free(fname);
+    return tmp;
+}
+
+/*
+ * -I: put the new index in place.  a gzipped log's index is all or nothing;
+ * a plain log's is good as far as it goes, and ug_build_index carries on
+ * from its last entry.  link() leaves alone an index someone else built in
+ * the meantime, and the .gzidx goes first: the .idx is what says there are
+ * indexes.
+ */
+void finish_index(int complete)
+{
+    char *fname, *gz_fname;
+
+    if ( ctx.new_index )
+        fclose(ctx.new_index);
+    if ( ctx.new_gz_index )
+        fclose(ctx.new_gz_index);
+
+    if ( complete ) {
+        fname = ug_get_index_fname(ctx.in_file, "idx");
+        if ( !ctx.new_gz_index_fname ) {
+            link(ctx.new_index_fname, fname);
+        } else if ( access(fname, F_OK) != 0 ) {
+            gz_fname = ug_get_index_fname(ctx.in_file, "gzidx");
+            if ( rename(ctx.new_gz_index_fname, gz_fname) == 0 )
+                link(ctx.new_index_fname, fname);
+            free(gz_fname);
+        }
+        free(fname);
+    }
+
+    unlink(ctx.new_index_fname);
+    if ( ctx.new_gz_index_fname )
+        unlink(ctx.new_gz_index_fname);
+
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    ctx.new_index = ctx.new_gz_index = NULL;
+    free(ctx.new_index_fname);
+    free(ctx.new_gz_index_fname);
+    ctx.new_index_fname = ctx.new_gz_index_fname = NULL;
+}
+
+/* -I: returns 1 if the log has no index and we've started writing one */
+int start_index()
+{
+    char *fname = ug_get_index_fname(ctx.in_file, "idx");
+
+    if ( access(fname, F_OK) == 0 ) {
+        free(fname);
+        return 0;
+    }
+    ctx.new_index_fname = temporary_fname(fname);
+    if ( is_gzipped(ctx.in_file) )
+        ctx.new_gz_index_fname = temporary_fname(ug_get_index_fname(ctx.in_file, "gzidx"));
+
+    signal(SIGTERM, abandon_index);
+    signal(SIGINT, abandon_index);
+    signal(SIGPIPE, abandon_index);
+
+    /* a log in a directory we can't write to is searched without */
+    ctx.last_index_time = 0;
+    if ( !(ctx.new_index = fopen(ctx.new_index_fname, "w"))
+         || (ctx.new_gz_index_fname && !(ctx.new_gz_index = fopen(ctx.new_gz_index_fname, "w"))) ) {
+        finish_index(0);
+        return 0;
+    }
+    return 1;
+}
+
+/* search ctx.in_file, with the framer in its initial state */
+int search_file(lua_State *lua)
+{
+    FILE *file, *gz_index;
+    off_t offset;
+    ug_span_t *spans = NULL;
+    size_t num_spans;
+    int cached = 0, threaded = 0, indexing, unindexed;
+    ug_meta_t *meta = NULL;
+
+    file = fopen(ctx.in_file, "r");
+    if ( !file ) {
+        perror(ctx.in_file);
+        return -1;
+    }
+
+    if ( (unindexed = open_indexes(ctx.in_file, &offset, &gz_index)) == -1 ) {
+        fclose(file);
+        return -1;
+    }
+
+    /* the cache doesn't know about -W or -k */
+    if ( ctx.num_preds && !ctx.sample_rate && !ctx.reverse && (meta = open_meta(file)) && meta_spans(meta, &spans, &num_spans) == -1 ) {
+        ug_meta_free(meta);
+        meta = NULL;
+    }
+
+    if ( ctx.use_cache && !ctx.num_preds && !ctx.num_keys && !ctx.sample_rate && !ctx.reverse ) {
+        ctx.cache = ug_cache_open(ctx.in_file, file, ctx.lua_file, ctx.regexp_args, ctx.num_regexps,
+                                  ctx.start_time, ctx.end_time);
+        if ( ctx.cache )
+            cached = ug_cache_lookup(ctx.cache, &spans, &num_spans);
+    }
+
+    /* the kernel reads it in on its own time; this doesn't wait for it */
+    if ( ctx.prefetch )
+        ug_prefetch(ctx.prefetch, ctx.start_time);
+
+    /* the first search of a log without an index pays for the ones after it */
+    indexing = ctx.index_on_read && !ctx.sample_rate && !ctx.reverse && !cached && !meta && start_index();
+
+    /* without one (and not writing one), a plain log is bisected for where to start */
+    if ( unindexed && !indexing && !is_gzipped(ctx.in_file) && !ctx.sample_rate && !ctx.reverse && !cached && !meta )
+        offset = ug_bisect(file, lua, ctx.start_time);
+
+    init_scan(&main_scan, lua, file, stdout);
+    ug_gzip_drop_behind = ctx.drop_cache;
+    if ( ctx.sample_rate ) {
+        search_sample(lua, file, gz_index);
+    } else if ( ctx.reverse ) {
+        search_reverse(lua, file, gz_index);
+    } else if ( cached ) {
+        read_cached_spans(file, gz_index, spans, num_spans);
+        free(spans);
+    } else if ( meta ) {
+        ctx.prefiltered = 1;
+        read_cached_spans(file, gz_index, spans, num_spans);
+        ctx.prefiltered = 0;
+        free(spans);
+
+        /* a plain log may have grown past what the sidecar has */
+        if ( !is_gzipped(ctx.in_file) && !main_scan.stopped && main_scan.max_request_time <= ctx.end_time ) {
+            lseek(fileno(file), meta->covered, SEEK_SET);
+            rewind_scan(scan, meta->covered);
+            frame_file(lua, file);
+            frame_eof(lua);
+        }
+        ug_meta_free(meta);
+    } else if ( is_gzipped(ctx.in_file) && indexing ) {
+        indexing = ug_gzip_cat_indexing(file, ctx.new_gz_index, frame_output, lua) == Z_STREAM_END;
+        frame_eof(lua);
+        finish_index(indexing);
+    } else if ( is_gzipped(ctx.in_file) ) {
+        ug_gzip_cat(file, offset, gz_index, frame_output, lua);
+        frame_eof(lua);
+    } else if ( ctx.threads > 1 && !ctx.cache && !ctx.max_count && !indexing ) {
+        /* prints its own stats */
+        search_in_threads(lua, file, offset);
+        threaded = 1;
+    } else {
+        fseeko(file, offset, SEEK_SET);
+        rewind_scan(scan, offset);
+        frame_file(lua, file);
+        frame_eof(lua);
+        if ( indexing )
+            finish_index(1);
+    }
+
+    /* an exact hit has nothing new to remember, after -m matches we didn't see it all,
+       and what -L left out a search with another limit may well match */
+    if ( ctx.cache && cached != 2 && !(ctx.max_count && main_scan.matched >= ctx.max_count) && !hit_limit(&main_scan) )
+        ug_cache_store(ctx.cache);
+
+    if ( ctx.stats && !threaded )
+        print_stats(ctx.in_file, &main_scan, 1);
+    if ( !threaded )
+        print_limits(&main_scan, 1);
+    free_scan(&main_scan);
+
+    /* what wasn't dropped as it was read: cached reads, the last stretch */
+    if ( ctx.drop_cache )
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+
+    fclose(file);
+    if ( gz_index )
+        fclose(gz_index);
+    return 0;
+}
+
+/* forget everything about the last search, keeping the buffers and compiled regexps */
+void reset_search()
+{
+    int i;
+
+    free(ctx.regexps);
+    ctx.regexps = NULL;
+    if ( ctx.literals )
+        ug_literal_free(ctx.literals);
+    ctx.literals = NULL;
+    ctx.num_regexps = 0;
+    ctx.stats = 0;
+    ctx.threads = 0;
+    ctx.max_count = 0;
+    ctx.match_limit = 0;
+    ctx.abort_on_limit = 0;
+    ctx.limits.flags = 0;
+    for (i = 0; i < ctx.num_fields; i++) {
+        free(ctx.field_names[i]);
+        free(ctx.field_args[i]);
+    }
+    ctx.num_fields = 0;
+    for (i = 0; i < ctx.num_preds; i++) {
+        free(ctx.preds[i].name);
+        free(ctx.preds[i].value);
+    }
+    ctx.num_preds = 0;
+    for (i = 0; i < ctx.num_keys; i++) {
+        free(ctx.keys[i].name);
+        free(ctx.keys[i].value);
+    }
+    ctx.num_keys = 0;
+    ctx.utf8 = 0;
+    ctx.regexp_args = NULL;
+    free(ctx.in_file);
+    ctx.in_file = NULL;
+    free(ctx.prefetch);
+    ctx.prefetch = NULL;
+    ctx.drop_cache = 0;
+    ctx.sample_rate = 0;
+    ctx.reverse = 0;
+    ctx.index_on_read = 0;
+    ctx.use_cache = 0;
+    if ( ctx.cache )
+        ug_cache_free(ctx.cache);
+    ctx.cache = NULL;
+}
+
+#define MAX_JOB_ARGS 256
+
+/*
+ * a long-lived ug_guts: the lua state and the compiled regexps stay warm, and
+ * each search only costs the scan itself.
+ */
+void run_worker(lua_State *lua)
+{
+    extern int optind;
+    char *line = NULL, *job_argv[MAX_JOB_ARGS], *arg, *save;
+    size_t allocated = 0;
+    ssize_t len;
+    int job_argc;
+
+    while ( (len = getline(&line, &allocated, stdin)) > 0 ) {
+        if ( line[len - 1] == '\n' )
+            line[len - 1] = '\0';
+
+        job_argv[0] = "ug_guts";
+        job_argc = 1;
+        for (arg = strtok_r(line, "\t", &save); arg && job_argc < MAX_JOB_ARGS; arg = strtok_r(NULL, "\t", &save))
+            job_argv[job_argc++] = arg;
+
+        reset_search();
+        optind = 0;
+        if ( parse_args(job_argc, job_argv) == -1 || !ctx.in_file || !ctx.num_regexps ) {
+            fprintf(stderr, "ug_guts: bad search\n");
+        } else {
+            ug_lua_reset(lua);
+            search_file(lua);
+        }
+
+        printf("@@done\n");
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    lua_State *lua;
+    unsigned long printed = 0;
 
     bzero(&ctx, sizeof(context_t));
     if ( parse_args(argc, argv) == -1 ) {
@@ -177,27 +2006,32 @@ int main(int argc, char **argv)
     lua = ug_lua_init(ctx.lua_file);
     if ( !lua )
       exit(1);
+    ctx.luas[0] = lua;
 
-    if ( ctx.in_file ) {
-      file = fopen(ctx.in_file, "r");
-      if ( !file ) {
-        perror(ctx.in_file);
-        exit(1);
-      }
+    if ( ctx.worker ) {
+        run_worker(lua);
+    } else if ( ctx.in_file ) {
+        if ( search_file(lua) == -1 )
+            exit(1);
     } else {
-      file = stdin;
-    }
-
-    while (1) {
-        line_size = getline(&line, &allocated, file);
-        if ( line_size < 0 )
-          break;
-
-        ug_process_line(lua, line, line_size, offset);
-        offset += line_size;
-
-        if ( max_request_time > ctx.end_time)
-            break;
+        if ( ctx.prefetch )
+            ug_prefetch(ctx.prefetch, ctx.start_time);
+        init_scan(&main_scan, lua, stdin, ctx.reverse ? tmpfile() : stdout);
+        if ( !main_scan.out ) {
+            perror("Couldn't spool matches");
+            exit(1);
+        }
+        frame_file(lua, stdin);
+        frame_eof(lua);
+        /* a pipe can only be turned around once it's all in */
+        if ( ctx.reverse )
+            print_spooled(&main_scan, stdout, &printed);
+        /* a pipe can only be counted all the way through */
+        if ( ctx.sample_rate )
+            print_sample(1, 1, main_scan.matched, (double) main_scan.matched * main_scan.matched);
+        if ( ctx.stats )
+            print_stats("stdin", &main_scan, 1);
+        print_limits(&main_scan, 1);
     }
-    ug_lua_on_eof(lua);
+    exit(0);
 }
@@ -51,17 +51,13 @@
 #include "ug_index.h"
 #include "ug_lua.h"
 #include "ug_gzip.h"
+#include "ug_buffer.h"
 
 
-// how often (in uncompressed bytes) to add an index
-#define INDEX_EVERY_NBYTES 30000000
-
 /*
- * parse the contents of the circular gzip buffer line by line.  when a request
- * spans gzip blocks, we have to leave the request in the buffer and wait for the next block
- *
- * maintains 3 pointers - where we would read next in the buffer, where we're writing next, and the
- * allocated outputbuffer.
+ * hand the uncompressed data to the framer line by line.  inflate() writes into
+ * a circular window; whatever is new in it since the last call gets appended
+ * to a line buffer, so lines that span gzip blocks come out whole.
  */
 
 struct gz_output_context {
@@ -70,8 +66,7 @@ struct gz_output_context {
 
     unsigned char *start;                // point in the window where the data is to be read from
 
-    char *line;                 // buffer for an output line
-    int line_len;
+    ug_buffer_t lines;
     off_t total_out;
     off_t total_in;
     off_t last_index_offset;
@@ -81,41 +76,24 @@ struct gz_output_context {
 
 void process_circular_buffer(struct gz_output_context *c)
 {
-    int eol;
-    unsigned char *p, *end_of_window;
+    unsigned char *end_of_window;
+    char *line;
+    size_t line_len;
+    off_t offset;
 
     end_of_window = c->window + c->window_len;
-    for (;;) {
-        p = c->start;
-
-        /* skip to newline or end of buffer */
-        while ((*p != '\n') && p < end_of_window)
-            p++;
-
-        eol = (p < end_of_window);
-        if ( eol ) p++; /* preserve newline */
-
-        c->line = realloc(c->line, (p - c->start) + c->line_len + 1);
-        memcpy(c->line + c->line_len, c->start, p - c->start);
-        c->line_len += (p - c->start);
-        c->total_out += (p - c->start);
-
-        if (!eol) {
-            if (c->window_len == WINSIZE)       /* buffer is full, wrap back to top of input buffer to complete the line */
-                c->start = c->window;
-            else                /* out of data in the input buffer but the line didn't terminate, continue to next block to complete the line */
-                c->start = p;
-            return;
-        } else {
-            c->line[c->line_len] = '\0';
-            ug_process_line(c->build_idx_context->lua, c->line, c->line_len, c->total_out - c->line_len);
-
-            free(c->line);
-            c->line = NULL;
-            c->line_len = 0;
-            c->start = p;
-        }
-    }
+    ug_buffer_append(&c->lines, c->start, end_of_window - c->start);
+    c->total_out += end_of_window - c->start;
+
+    while ((line = ug_buffer_next_line(&c->lines, &line_len, &offset)))
+        ug_process_line(c->build_idx_context->lua, line, line_len, offset);
+    if (!c->build_idx_context->hold_lines)
+        c->lines.keep = c->lines.base + c->lines.scanned;
+
+    if (c->window_len == WINSIZE)       /* buffer is full, inflate() starts over at the top */
+        c->start = c->window;
+    else
+        c->start = end_of_window;
 }
 
 int need_gz_index(z_stream * strm, struct gz_output_context *c)
@@ -127,22 +105,8 @@ int need_gz_index(z_stream * strm, struct gz_output_context *c)
 
 void add_gz_index(z_stream * strm, struct gz_output_context *c, unsigned char *window)
 {
-    off_t compressed_offset;
-
-    compressed_offset = (((uint64_t) strm->data_type & 7) << 56);
-    compressed_offset |= (c->total_in & 0x00FFFFFFFFFFFFFF);
-
-    fwrite(&(c->total_out), sizeof(off_t), 1, c->build_idx_context->fgzindex);
-    fwrite(&compressed_offset, sizeof(off_t), 1, c->build_idx_context->fgzindex);
-
-    if (strm->avail_out) {
-        fwrite(window + (WINSIZE - strm->avail_out), strm->avail_out, 1, c->build_idx_context->fgzindex);
-    }
-
-    /* copy from beginning -> middle of buffer if needed */
-    if (strm->avail_out < WINSIZE)
-        fwrite(window, WINSIZE - strm->avail_out, 1, c->build_idx_context->fgzindex);
-
+    ug_gzip_write_access_point(c->build_idx_context->fgzindex, c->total_out, c->total_in, strm->data_type,
+                               window, strm->avail_out);
     c->last_index_offset = c->total_out;
 }
 
@@ -162,12 +126,16 @@ int build_gz_index(build_idx_context_t * cxt)
     unsigned char input[CHUNK];
     unsigned char window[WINSIZE];
     struct gz_output_context output_cxt;
+    char *line;
+    size_t line_len;
+    off_t offset;
 
     bzero(&strm, sizeof(z_stream));
     bzero(&output_cxt, sizeof(struct gz_output_context));
 
     output_cxt.window = output_cxt.start = window;
     output_cxt.build_idx_context = cxt;
+    cxt->lines = &output_cxt.lines;
 
     ret = inflateInit2(&strm, 47);      /* automatic zlib or gzip decoding */
     if (ret != Z_OK)
@@ -208,13 +176,13 @@ int build_gz_index(build_idx_context_t * cxt)
                 ret = Z_DATA_ERROR;
             if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
                 goto build_index_error;
-            if (ret == Z_STREAM_END)
-                break;
 
             output_cxt.window_len = WINSIZE - strm.avail_out;
 
             /* process the uncompressed line data so that the timestamp -> uncompressed offset index gets written */
             process_circular_buffer(&output_cxt);
+            if (ret == Z_STREAM_END)
+                break;
 
             /*
              *
@@ -230,13 +198,25 @@ int build_gz_index(build_idx_context_t * cxt)
         } while (strm.avail_in != 0);
     } while (ret != Z_STREAM_END);
 
+    /* a last line without a newline */
+    if ((line = ug_buffer_rest(&output_cxt.lines, &line_len, &offset)))
+        ug_process_line(cxt->lua, line, line_len, offset);
+
+    /* the framer's last request, while its lines are still around */
+    ug_lua_on_eof(cxt->lua);
+
     /* clean up and return index (release unused entries in list) */
     (void) inflateEnd(&strm);
+    free(output_cxt.lines.data);
+    cxt->lines = NULL;
     return 0;
 
     /* return error */
   build_index_error:
+    ug_lua_on_eof(cxt->lua);
     (void) inflateEnd(&strm);
+    free(output_cxt.lines.data);
+    cxt->lines = NULL;
     return ret;
 }
 
@@ -1,8 +1,25 @@
 #ifndef _UG_GZIP_H
 #define _UG_GZIP_H
 
+#include <stdio.h>
+#include <sys/types.h>
+
 #define WINSIZE 32768U          /* sliding window size */
 #define CHUNK 16384             /* file input buffer size */
+#define INDEX_EVERY_NBYTES 30000000     /* how often (in uncompressed bytes) to add an access point */
+
+/* drop the compressed log from the page cache as it's read, like ug_buffer_t's drop_behind (ug_guts -D) */
+extern int ug_gzip_drop_behind;
+
+/* receives a chunk of uncompressed data and its offset in the uncompressed stream; return non-zero to stop */
+typedef int (*ug_output_fn)(void *arg, unsigned char *data, size_t len, off_t offset);
 
 int build_gz_index(build_idx_context_t *);
+int fill_gz_info(off_t target_offset, FILE * gz_index, unsigned char *dict_data, off_t * compressed_offset,
+                 off_t * access_point_offset);
+off_t ug_gzip_next_access_point(FILE * gz_index, off_t target_offset);
+int ug_gzip_cat(FILE * in, off_t target_offset, FILE * gz_index, ug_output_fn output, void *arg);
+int ug_gzip_cat_indexing(FILE * in, FILE * new_gz_index, ug_output_fn output, void *arg);
+void ug_gzip_write_access_point(FILE * gz_index, off_t uncompressed_offset, off_t compressed_offset, int bits,
+                                unsigned char *window, unsigned avail_out);
 #endif
@@ -0,0 +1,233 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+/* 
+ * random access reads of gzipped logs, using the access points ug_build_index
+ * stores in the .gzidx file.  see ug_gzip.c for the index format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include "zlib.h"
+#include "ug_index.h"
+#include "ug_gzip.h"
+#include "ug_buffer.h"
+
+int ug_gzip_drop_behind;
+
+/* 
+ * target_offset is the offset in the uncompressed stream we're looking for.
+ * finds the last access point at or before it; returns 0 if there's none.
+ */
+int fill_gz_info(off_t target_offset, FILE * gz_index, unsigned char *dict_data, off_t * compressed_offset,
+                 off_t * access_point_offset)
+{
+    off_t uncompressed_offset = 0;
+    int found = 0;
+
+    rewind(gz_index);
+    for (;;) {
+        if (!fread(&uncompressed_offset, sizeof(off_t), 1, gz_index))
+            break;
+
+        if (uncompressed_offset > target_offset)
+            break;
+
+        if (!fread(compressed_offset, sizeof(off_t), 1, gz_index))
+            break;
+
+        if (!fread(dict_data, WINSIZE, 1, gz_index))
+            break;
+
+        *access_point_offset = uncompressed_offset;
+        found = 1;
+    }
+    return found;
+}
+
+/* the first access point after target_offset, or -1 if there's none */
+off_t ug_gzip_next_access_point(FILE * gz_index, off_t target_offset)
+{
+    off_t uncompressed_offset;
+
+    rewind(gz_index);
+    while (fread(&uncompressed_offset, sizeof(off_t), 1, gz_index)) {
+        if (uncompressed_offset > target_offset)
+            return uncompressed_offset;
+        if (fseeko(gz_index, sizeof(off_t) + WINSIZE, SEEK_CUR) == -1)
+            break;
+    }
+    return -1;
+}
+
+/*
+ * an access point at the end of a deflate block: where it is in both streams
+ * (the bits of its first byte that belong to the block before in the offset's
+ * high byte) and the 32K of uncompressed data before it, from the circular
+ * window inflate() is writing into -- the oldest of it starts at avail_out
+ * bytes from the end.
+ */
+void ug_gzip_write_access_point(FILE * gz_index, off_t uncompressed_offset, off_t compressed_offset, int bits,
+                                unsigned char *window, unsigned avail_out)
+{
+    compressed_offset = (((uint64_t) bits & 7) << 56) | (compressed_offset & 0x00FFFFFFFFFFFFFF);
+
+    fwrite(&uncompressed_offset, sizeof(off_t), 1, gz_index);
+    fwrite(&compressed_offset, sizeof(off_t), 1, gz_index);
+
+    if (avail_out)
+        fwrite(window + (WINSIZE - avail_out), avail_out, 1, gz_index);
+
+    /* copy from beginning -> middle of buffer if needed */
+    if (avail_out < WINSIZE)
+        fwrite(window, WINSIZE - avail_out, 1, gz_index);
+}
+
+/* 
+ * inflate the file, starting from the last access point at or before
+ * target_offset (or from the top if there's no gz_index), and hand the
+ * uncompressed data from target_offset on to output() along with its offset
+ * in the uncompressed stream.  whatever comes between the access point and
+ * target_offset is inflated and thrown away here, so the caller doesn't have
+ * to frame it only to find it's too early.  output() may return non-zero to
+ * stop early.
+ *
+ * with new_gz_index, it inflates a block at a time from the top and writes
+ * access points to it along the way, like ug_build_index does.
+ *
+ * returns Z_OK / Z_STREAM_END on success, or Z_DATA_ERROR, Z_MEM_ERROR or
+ * Z_ERRNO. Z_DATA_ERROR shouldn't happen unless the file was modified since
+ * the index was generated.
+ */
+static int gzip_cat(FILE * in, off_t target_offset, FILE * gz_index, FILE * new_gz_index, ug_output_fn output, void *arg)
+{
+    int ret, bits = 0;
+    off_t compressed_offset = 0, uncompressed_offset = 0, last_point = 0, skip, read_to, dropped;
+    size_t have;
+    z_stream strm;
+    unsigned char input[CHUNK];
+    unsigned char out[WINSIZE], dict[WINSIZE], *next;
+
+    /* initialize file and inflate state to start there */
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+
+    bzero(dict, WINSIZE);
+    bzero(out, WINSIZE);
+
+    if (gz_index && fill_gz_info(target_offset, gz_index, dict, &compressed_offset, &uncompressed_offset)) {
+        bits = compressed_offset >> 56;
+        compressed_offset = (compressed_offset & 0x00FFFFFFFFFFFFFF) - (bits ? 1 : 0);
+
+        ret = inflateInit2(&strm, -15);     /* raw inflate */
+        if (ret != Z_OK)
+            return ret;
+
+        ret = fseeko(in, compressed_offset, SEEK_SET);
+        if (ret == -1) {
+            ret = Z_ERRNO;
+            goto extract_ret;
+        }
+
+        if (bits) {
+            ret = getc(in);
+            if (ret == -1) {
+                ret = ferror(in) ? Z_ERRNO : Z_DATA_ERROR;
+                goto extract_ret;
+            }
+            (void) inflatePrime(&strm, bits, ret >> (8 - bits));
+        }
+
+        inflateSetDictionary(&strm, dict, WINSIZE);
+    } else {
+        compressed_offset = uncompressed_offset = 0;
+        ret = fseeko(in, 0, SEEK_SET);
+        if (ret == -1)
+            return Z_ERRNO;
+
+        ret = inflateInit2(&strm, 47);      /* automatic zlib or gzip decoding */
+        if (ret != Z_OK)
+            return ret;
+    }
+
+    /* we read on to the end from here: let the kernel read ahead further than it would by default */
+    posix_fadvise(fileno(in), compressed_offset, 0, POSIX_FADV_SEQUENTIAL);
+    dropped = compressed_offset;
+
+    /* out is a circular window: access points need the 32K before them */
+    strm.avail_out = 0;
+    for (;;) {
+        if (strm.avail_out == 0) {
+            strm.avail_out = WINSIZE;
+            strm.next_out = out;
+        }
+        next = strm.next_out;
+
+        if (!strm.avail_in) {
+            strm.avail_in = fread(input, 1, CHUNK, in);
+            strm.next_in = input;
+
+            if (ug_gzip_drop_behind && (read_to = ftello(in)) - dropped >= UG_DROP_BATCH) {
+                posix_fadvise(fileno(in), dropped, read_to - dropped, POSIX_FADV_DONTNEED);
+                dropped = read_to;
+            }
+        }
+
+        if (ferror(in)) {
+            ret = Z_ERRNO;
+            goto extract_ret;
+        }
+
+        if (strm.avail_in == 0) {
+            ret = Z_DATA_ERROR;
+            goto extract_ret;
+        }
+
+        ret = inflate(&strm, new_gz_index ? Z_BLOCK : Z_NO_FLUSH);
+
+        if (ret == Z_NEED_DICT)
+            ret = Z_DATA_ERROR;
+        if (ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+            goto extract_ret;
+
+        have = strm.next_out - next;
+        if (have && uncompressed_offset + (off_t) have > target_offset) {
+            skip = target_offset > uncompressed_offset ? target_offset - uncompressed_offset : 0;
+            if (output(arg, next + skip, have - skip, uncompressed_offset + skip))
+                break;
+        }
+        uncompressed_offset += have;
+
+        /* if reach end of stream, then don't keep trying to get more */
+        if (ret == Z_STREAM_END)
+            break;
+
+        /* at the end of a deflate block that isn't the last one */
+        if (new_gz_index && (strm.data_type & 128) && !(strm.data_type & 64)
+            && (last_point == 0 || uncompressed_offset - last_point > INDEX_EVERY_NBYTES)) {
+            ug_gzip_write_access_point(new_gz_index, uncompressed_offset, strm.total_in, strm.data_type & 7,
+                                       out, strm.avail_out);
+            last_point = uncompressed_offset;
+        }
+    }
+
+    /* clean up and return bytes read or error */
+  extract_ret:
+    (void) inflateEnd(&strm);
+    return ret;
+}
+
+int ug_gzip_cat(FILE * in, off_t target_offset, FILE * gz_index, ug_output_fn output, void *arg)
+{
+    return gzip_cat(in, target_offset, gz_index, NULL, output, arg);
+}
+
+/* all of the file, writing a .gzidx for it to new_gz_index as we go */
+int ug_gzip_cat_indexing(FILE * in, FILE * new_gz_index, ug_output_fn output, void *arg)
+{
+    return gzip_cat(in, 0, NULL, new_gz_index, output, arg);
+}
@@ -46,6 +46,22 @@ off_t ug_get_offset_for_timestamp(FILE * findex, uint64_t time)
     return last_offset;
 }
 
+/*
+ * where the requests after time start: the first entry past it, or -1 if the
+ * index doesn't go that far.  entry times are floored, so everything from
+ * that entry on is later than time (as far as the log is in order).
+ */
+off_t ug_get_end_offset_for_timestamp(FILE * findex, uint64_t time)
+{
+    struct ug_index idx;
+
+    while (ug_read_index_entry(findex, &idx)) {
+        if (idx.time > time)
+            return idx.offset;
+    }
+    return -1;
+}
+
 /* returns malloc'ed memory. */
 char *ug_get_index_fname(char *log_fname, char *ext)
 {
@@ -1,7 +1,11 @@
+#ifndef _UG_INDEX_H
+#define _UG_INDEX_H
+
 #include <stdint.h>
 #include <stdio.h>
 #include <lua.h>
 #include <time.h>
+#include "ug_buffer.h"
 #define INDEX_EVERY 10
 
 struct ug_index {
@@ -15,9 +19,14 @@ typedef struct {
     FILE *findex;
     FILE *fgzindex;
     lua_State *lua;
+    ug_buffer_t *lines;         /* the framer's input, for finding requests in */
+    int hold_lines;             /* keep lines around until the request they're in is handled */
+    int at_eof;
 } build_idx_context_t;
 
 void ug_write_index(FILE * file, uint64_t time, uint64_t offset);
 int ug_get_last_index_entry(FILE * file, struct ug_index *idx);
 off_t ug_get_offset_for_timestamp(FILE * findex, uint64_t time);
+off_t ug_get_end_offset_for_timestamp(FILE * findex, uint64_t time);
 char *ug_get_index_fname(char *log_fname, char *ext);
+#endif
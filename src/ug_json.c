@@ -0,0 +1,230 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "request.h"
+#include "ug_json.h"
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+/* p is at the opening quote; returns what's after the closing one, or NULL */
+static const char *skip_string(const char *p, const char *end)
+{
+    const char *q, *b;
+
+    for (p++; p < end; p = q + 1) {
+        q = memchr(p, '"', end - p);
+        if (!q)
+            return NULL;
+
+        /* an odd number of backslashes in front of it means it's escaped */
+        b = q;
+        while (b > p && b[-1] == '\\')
+            b--;
+        if ((q - b) % 2 == 0)
+            return q + 1;
+    }
+    return NULL;
+}
+
+/* what's after the value at p, or NULL if it runs off the end */
+static const char *skip_value(const char *p, const char *end)
+{
+    int depth = 0;
+
+    if (p >= end)
+        return NULL;
+
+    if (*p == '"')
+        return skip_string(p, end);
+
+    if (*p != '{' && *p != '[') {
+        while (p < end && !strchr(",}] \t\r\n", *p))
+            p++;
+        return p;
+    }
+
+    while (p < end) {
+        switch (*p) {
+            case '"':
+                if (!(p = skip_string(p, end)))
+                    return NULL;
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0)
+                    return p + 1;
+                break;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+int ug_json_find(const char *buf, size_t len, const char *path, const char **value, size_t * value_len)
+{
+    const char *p = buf, *end = buf + len, *key, *key_end, *v, *v_end, *dot;
+    size_t name_len;
+
+    dot = strchr(path, '.');
+    name_len = dot ? (size_t) (dot - path) : strlen(path);
+
+    p = skip_space(p, end);
+    if (p == end || *p != '{')
+        return 0;
+    p++;
+
+    for (;;) {
+        p = skip_space(p, end);
+        if (p == end || *p != '"')
+            return 0;
+        key = p + 1;
+        if (!(p = skip_string(p, end)))
+            return 0;
+        key_end = p - 1;
+
+        p = skip_space(p, end);
+        if (p == end || *p != ':')
+            return 0;
+        v = skip_space(p + 1, end);
+        if (!(v_end = skip_value(v, end)))
+            return 0;
+
+        if ((size_t) (key_end - key) == name_len && memcmp(key, path, name_len) == 0) {
+            if (dot)
+                return ug_json_find(v, v_end - v, dot + 1, value, value_len);
+            if (*v == '"') {
+                *value = v + 1;
+                *value_len = (v_end - v) - 2;
+            } else {
+                *value = v;
+                *value_len = v_end - v;
+            }
+            return 1;
+        }
+
+        p = skip_space(v_end, end);
+        if (p == end || *p != ',')
+            return 0;
+        p++;
+    }
+}
+
+/* n digits at *p, moving *p past them; -1 if they aren't there */
+static int digits(const char **p, const char *end, int n)
+{
+    int value = 0;
+
+    for (; n > 0; n--, (*p)++) {
+        if (*p >= end || **p < '0' || **p > '9')
+            return -1;
+        value = value * 10 + (**p - '0');
+    }
+    return value;
+}
+
+/* one of chars at *p, moving *p past it */
+static int separator(const char **p, const char *end, const char *chars)
+{
+    if (*p >= end || !strchr(chars, **p))
+        return 0;
+    (*p)++;
+    return 1;
+}
+
+time_t ug_json_time(const char *value, size_t len)
+{
+    const char *p = value, *end = value + len;
+    struct tm tm;
+    char number[32], *number_end;
+    double seconds;
+    time_t t;
+    int sign, hours, minutes;
+
+    if (len && len < sizeof(number) && !memchr(value, '-', len) && !memchr(value, ':', len)) {
+        memcpy(number, value, len);
+        number[len] = '\0';
+        seconds = strtod(number, &number_end);
+        if (*number_end)
+            return 0;
+        /* milliseconds, unless it's past the year 5000 */
+        return seconds > 1e11 ? (time_t) (seconds / 1000) : (time_t) seconds;
+    }
+
+    memset(&tm, 0, sizeof(tm));
+    if ((tm.tm_year = digits(&p, end, 4)) < 0 || !separator(&p, end, "-")
+        || (tm.tm_mon = digits(&p, end, 2)) < 0 || !separator(&p, end, "-")
+        || (tm.tm_mday = digits(&p, end, 2)) < 0 || !separator(&p, end, "T ")
+        || (tm.tm_hour = digits(&p, end, 2)) < 0 || !separator(&p, end, ":")
+        || (tm.tm_min = digits(&p, end, 2)) < 0 || !separator(&p, end, ":")
+        || (tm.tm_sec = digits(&p, end, 2)) < 0)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    t = timegm(&tm);
+
+    if (separator(&p, end, ".,"))
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+
+    /* no zone is UTC, like the strptime_format framers */
+    if (p < end && (*p == '+' || *p == '-')) {
+        sign = *p++ == '+' ? 1 : -1;
+        if ((hours = digits(&p, end, 2)) < 0)
+            return t;
+        separator(&p, end, ":");
+        if ((minutes = digits(&p, end, 2)) < 0)
+            minutes = 0;
+        t -= sign * (hours * 60 + minutes) * 60;
+    }
+    return t;
+}
+
+/* a record that's come in pieces so far (see ug_buffer_t's max_line), reported once its newline shows up */
+static __thread request_t pending;
+static __thread int continued;
+
+void ug_json_frame_line(char *line, size_t len, off_t offset, const char *time_field)
+{
+    const char *value;
+    size_t value_len;
+
+    if (continued) {
+        pending.length += len;
+    } else {
+        if (skip_space(line, line + len) == line + len)
+            return;
+
+        /* a record's time had better be in its first piece */
+        pending.buf = NULL;
+        pending.offset = offset;
+        pending.length = len;
+        pending.time = ug_json_find(line, len, time_field, &value, &value_len) ? ug_json_time(value, value_len) : 0;
+    }
+
+    continued = line[len - 1] != '\n';
+    if (!continued)
+        handle_request(&pending);
+}
+
+void ug_json_frame_eof(void)
+{
+    if (continued)
+        handle_request(&pending);
+    continued = 0;
+}
+
+void ug_json_frame_reset(void)
+{
+    continued = 0;
+}
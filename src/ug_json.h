@@ -0,0 +1,33 @@
+#ifndef _UG_JSON_H
+#define _UG_JSON_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*
+ * JSON-lines logs: one record per line.  nothing gets parsed into a tree --
+ * we walk the record's text just far enough to find the one value we're
+ * after, stepping over everything else a bracket or a string at a time.
+ */
+
+/*
+ * the value at path ("status", or "user.id" for nested objects) in the record;
+ * strings come back without their quotes (escapes left as they are), anything
+ * else as its literal text.  0 if the record doesn't have it.
+ */
+int ug_json_find(const char *buf, size_t len, const char *path, const char **value, size_t * value_len);
+
+/* a timestamp value: seconds (or milliseconds) since the epoch, or "YYYY-MM-DD[T ]HH:MM:SS[.frac][Z|+HH:MM]" */
+time_t ug_json_time(const char *value, size_t len);
+
+/*
+ * the built-in framer: every non-blank line is a request, timed by its time_field.
+ * a line that comes in pieces is one request, reported with its last piece (or
+ * by ug_json_frame_eof(), if the log ends without a newline).
+ */
+void ug_json_frame_line(char *line, size_t len, off_t offset, const char *time_field);
+void ug_json_frame_eof(void);
+void ug_json_frame_reset(void);
+
+#endif
@@ -0,0 +1,131 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdlib.h>
+#include <string.h>
+#include "ug_literal.h"
+
+/* anything pcre would read as more than itself */
+#define REGEXP_SPECIALS "\\^$.|?*+()[]{}"
+
+int ug_literal_parse(const char *regexp, char *out, size_t * len)
+{
+    const char *p;
+
+    *len = 0;
+    for (p = regexp; *p; p++) {
+        if ( *p == '\\' ) {
+            /* \. \/ and friends are the character itself; \d \n \b etc. are not */
+            p++;
+            if ( !*p || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') )
+                return 0;
+        } else if ( strchr(REGEXP_SPECIALS, *p) ) {
+            return 0;
+        }
+        out[(*len)++] = *p;
+    }
+    return *len > 0;
+}
+
+static int new_state(ug_literal_t * ac)
+{
+    int s = ac->num_states++;
+
+    if ( ac->num_states > ac->allocated ) {
+        ac->allocated = ac->allocated ? ac->allocated * 2 : 64;
+        ac->next = realloc(ac->next, sizeof(*ac->next) * ac->allocated);
+        ac->match = realloc(ac->match, sizeof(int) * ac->allocated);
+        ac->dict = realloc(ac->dict, sizeof(int) * ac->allocated);
+    }
+    memset(ac->next[s], -1, sizeof(*ac->next));
+    ac->match[s] = -1;
+    ac->dict[s] = 0;
+    return s;
+}
+
+ug_literal_t *ug_literal_new()
+{
+    ug_literal_t *ac = calloc(1, sizeof(ug_literal_t));
+    new_state(ac);
+    return ac;
+}
+
+/* returns the pattern's number; the same string added twice gets the same one */
+int ug_literal_add(ug_literal_t * ac, const char *literal, size_t len)
+{
+    unsigned char c;
+    int s = 0, t;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        c = literal[i];
+        if ( ac->next[s][c] == -1 ) {
+            t = new_state(ac);
+            ac->next[s][c] = t;
+        }
+        s = ac->next[s][c];
+    }
+
+    if ( ac->match[s] == -1 )
+        ac->match[s] = ac->num_patterns++;
+    return ac->match[s];
+}
+
+/* fill in the failure transitions, breadth first, so scanning never backs up */
+void ug_literal_compile(ug_literal_t * ac)
+{
+    int *queue = malloc(sizeof(int) * ac->num_states), *fail = calloc(ac->num_states, sizeof(int));
+    int head = 0, tail = 0, s, t, c;
+
+    for (c = 0; c < 256; c++) {
+        t = ac->next[0][c];
+        if ( t == -1 ) {
+            ac->next[0][c] = 0;
+        } else {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    while ( head < tail ) {
+        s = queue[head++];
+        for (c = 0; c < 256; c++) {
+            t = ac->next[s][c];
+            if ( t == -1 ) {
+                ac->next[s][c] = ac->next[fail[s]][c];
+            } else {
+                fail[t] = ac->next[fail[s]][c];
+                ac->dict[t] = ac->match[fail[t]] != -1 ? fail[t] : ac->dict[fail[t]];
+                queue[tail++] = t;
+            }
+        }
+    }
+
+    free(queue);
+    free(fail);
+}
+
+void ug_literal_scan(ug_literal_t * ac, const char *buf, size_t len, unsigned char *found)
+{
+    const unsigned char *p = (const unsigned char *) buf, *end = p + len;
+    int s = 0, t, left = ac->num_patterns;
+
+    memset(found, 0, ac->num_patterns);
+    while ( p < end ) {
+        s = ac->next[s][*p++];
+        for (t = s; t; t = ac->dict[t]) {
+            if ( ac->match[t] != -1 && !found[ac->match[t]] ) {
+                found[ac->match[t]] = 1;
+                if ( --left == 0 )
+                    return;
+            }
+        }
+    }
+}
+
+void ug_literal_free(ug_literal_t * ac)
+{
+    free(ac->next);
+    free(ac->match);
+    free(ac->dict);
+    free(ac);
+}
@@ -0,0 +1,33 @@
+#ifndef _UG_LITERAL_H
+#define _UG_LITERAL_H
+
+#include <stddef.h>
+
+/*
+ * most of what people search for is plain text -- an account id, a path, an
+ * error class.  all the plain-text regexps of a query go into one aho-corasick
+ * automaton, which finds every one of them in a single pass over the request
+ * instead of one pcre_exec per regexp.
+ */
+
+typedef struct {
+    int (*next)[256];           /* next[state][byte]: the full transition table */
+    int *match;                 /* the pattern that ends in this state, or -1 */
+    int *dict;                  /* the next state down the failure chain that ends a pattern, or 0 */
+    int num_states;
+    int allocated;
+    int num_patterns;
+} ug_literal_t;
+
+/* if the regexp only matches the one string, put that in out (and its length in len) */
+int ug_literal_parse(const char *regexp, char *out, size_t * len);
+
+ug_literal_t *ug_literal_new(void);
+int ug_literal_add(ug_literal_t * ac, const char *literal, size_t len);
+void ug_literal_compile(ug_literal_t * ac);
+
+/* sets found[i] for every pattern i in buf; stops early once all are found */
+void ug_literal_scan(ug_literal_t * ac, const char *buf, size_t len, unsigned char *found);
+void ug_literal_free(ug_literal_t * ac);
+
+#endif
@@ -3,20 +3,37 @@
 #include <lualib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include "request.h"
 #include "lua.h"
+#include "ug_json.h"
  
 int ug_lua_request_add(lua_State *lua);
+int ug_lua_request_add_extent(lua_State *lua);
 
 static char *strptime_format = NULL;
 
+/*
+ * "json" (or "json:field") in place of a lua file picks the built-in
+ * JSON-lines framer, timed by the "time" (or the given) field.  the lua
+ * state is still there, it just isn't called.
+ */
+static char *json_time_field = NULL;
+
 lua_State *ug_lua_init(char *fname) {
 	lua_State *lua = luaL_newstate();
+
+  if ( strncmp(fname, "json", 4) == 0 && (fname[4] == '\0' || fname[4] == ':') ) {
+    json_time_field = strdup(fname[4] ? fname + 5 : "time");
+    return lua;
+  }
+
 	luaL_openlibs(lua);
  
 	static const struct luaL_Reg ug_request_lib[] = {
 		{"add", ug_lua_request_add},
+		{"add_extent", ug_lua_request_add_extent},
 		{NULL, NULL}};
 
   luaL_newlib(lua, ug_request_lib );   
@@ -27,6 +44,9 @@ lua_State *ug_lua_init(char *fname) {
     fprintf(stderr, "%s\n", lua_tostring(lua, -1));
     return NULL;
   }
+  /* keep the compiled chunk around so ug_lua_reset() can re-run it */
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, LUA_REGISTRYINDEX, "ug_chunk");
   lua_call(lua, 0, 0);
 
   lua_getglobal(lua, "process_line");
@@ -81,28 +101,52 @@ sub_mkgmt(struct tm *tm)
 	return (t < 0 ? (time_t) -1 : t);
 }
 
-int ug_lua_request_add(lua_State *lua) { 
+static time_t request_time(lua_State *lua, int idx) {
   struct tm request_tm;
-  const char *timestring;
-  request_t r;
 
-  r.buf = (char *)luaL_checkstring(lua, 1);
+  if ( lua_isnoneornil(lua, idx) )
+    return 0;
 
-  if ( lua_isnil(lua, 2) ) {
-    r.time = 0;
-  } else {
-    timestring = luaL_checkstring(lua, 2);
-    strptime(timestring, strptime_format, &request_tm);
-    r.time = sub_mkgmt(&request_tm);
-  }
+  bzero(&request_tm, sizeof(struct tm));
+  strptime(luaL_checkstring(lua, idx), strptime_format, &request_tm);
+  return sub_mkgmt(&request_tm);
+}
+
+/* ug_request.add(data, ts, offset) -- the framer assembled the request text itself */
+int ug_lua_request_add(lua_State *lua) { 
+  request_t r;
+  size_t length;
 
+  r.buf = (char *)luaL_checklstring(lua, 1, &length);
+  r.length = length;
+  r.time = request_time(lua, 2);
   r.offset = luaL_checknumber(lua, 3);
   handle_request(&r);
 
-  return 1;
+  return 0;
+}
+
+/* 
+ * ug_request.add_extent(offset, length, ts) -- the framer only tells us where
+ * the request lives in the stream; the text stays in the C side's read buffer.
+ */
+int ug_lua_request_add_extent(lua_State *lua) { 
+  request_t r;
+
+  r.buf = NULL;
+  r.offset = luaL_checknumber(lua, 1);
+  r.length = luaL_checknumber(lua, 2);
+  r.time = request_time(lua, 3);
+  handle_request(&r);
+
+  return 0;
 }
 
 void ug_process_line(lua_State *lua, char *line, int line_len, off_t offset) {
+  if ( json_time_field ) {
+    ug_json_frame_line(line, line_len, offset, json_time_field);
+    return;
+  }
   lua_getglobal(lua, "process_line");
   lua_pushlstring(lua, line, line_len);
   lua_pushnumber(lua, (lua_Number)offset);
@@ -110,10 +154,24 @@ void ug_process_line(lua_State *lua, char *line, int line_len, off_t offset) {
 }
 
 void ug_lua_on_eof(lua_State *lua) {
+  if ( json_time_field ) {
+    ug_json_frame_eof();
+    return;
+  }
   lua_getglobal(lua, "on_eof");
   if ( !lua_isnil(lua, -1) ) {
     lua_call(lua, 0, 0);
+  } else {
+    lua_pop(lua, 1);
   }
 }
 
-
+/* start a new file: re-running the chunk resets the framer's globals without reloading it */
+void ug_lua_reset(lua_State *lua) {
+  if ( json_time_field ) {
+    ug_json_frame_reset();
+    return;
+  }
+  lua_getfield(lua, LUA_REGISTRYINDEX, "ug_chunk");
+  lua_call(lua, 0, 0);
+}
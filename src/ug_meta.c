@@ -0,0 +1,414 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "ug_meta.h"
+
+/*
+ * sidecar file format:
+ * [ug_meta_header]
+ * [names_len bytes] -- the field names, each NUL-terminated
+ * then blocks of up to UG_META_BLOCK_ROWS rows:
+ * [ug_meta_block_header]
+ * [rows * uint64 time] [rows * uint64 offset] [rows * uint32 length]
+ * for each field: [rows * uint32 end of the row's value] [the values, back to back]
+ */
+#define UG_META_MAGIC 0x314d4755        /* "UGM1" */
+
+struct ug_meta_header {
+    uint32_t magic;
+    uint32_t num_fields;
+    uint32_t names_len;
+    uint32_t unused;
+    uint64_t inode;
+};
+
+struct ug_meta_block_header {
+    uint32_t rows;
+    uint32_t bytes;             /* of the block, after this header */
+    uint64_t min_time;
+    uint64_t max_time;
+    uint64_t end_offset;        /* where the last row's request ends */
+};
+
+static ug_meta_t *meta_new(char **fields, int num_fields)
+{
+    ug_meta_t *meta;
+    int i;
+
+    meta = calloc(1, sizeof(ug_meta_t));
+    meta->num_fields = num_fields;
+    meta->fields = malloc(sizeof(char *) * (num_fields ? num_fields : 1));
+    for (i = 0; i < num_fields; i++)
+        meta->fields[i] = strdup(fields[i]);
+
+    meta->times = malloc(sizeof(uint64_t) * UG_META_BLOCK_ROWS);
+    meta->offsets = malloc(sizeof(uint64_t) * UG_META_BLOCK_ROWS);
+    meta->lengths = malloc(sizeof(uint32_t) * UG_META_BLOCK_ROWS);
+    meta->ends = malloc(sizeof(uint32_t *) * (num_fields ? num_fields : 1));
+    meta->values = calloc(num_fields ? num_fields : 1, sizeof(char *));
+    meta->values_len = calloc(num_fields ? num_fields : 1, sizeof(size_t));
+    meta->values_allocated = calloc(num_fields ? num_fields : 1, sizeof(size_t));
+    for (i = 0; i < num_fields; i++)
+        meta->ends[i] = malloc(sizeof(uint32_t) * UG_META_BLOCK_ROWS);
+    return meta;
+}
+
+static void reserve_values(ug_meta_t * meta, int field, size_t len)
+{
+    if (meta->values_allocated[field] >= len)
+        return;
+    while (meta->values_allocated[field] < len)
+        meta->values_allocated[field] = meta->values_allocated[field] ? meta->values_allocated[field] * 2 : 65536;
+    meta->values[field] = realloc(meta->values[field], meta->values_allocated[field]);
+    if (!meta->values[field]) {
+        perror("Couldn't grow meta values");
+        exit(1);
+    }
+}
+
+static uint64_t log_inode(FILE * log)
+{
+    struct stat st;
+
+    if (fstat(fileno(log), &st) == -1)
+        return 0;
+    return st.st_ino;
+}
+
+/* read the header, and find how far the rows go; leaves the file at the first block */
+static ug_meta_t *meta_read_header(FILE * file)
+{
+    struct ug_meta_header header;
+    struct ug_meta_block_header block;
+    ug_meta_t *meta;
+    char *names, **fields, *p;
+    off_t blocks_start;
+    uint32_t i;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != UG_META_MAGIC)
+        return NULL;
+
+    names = malloc(header.names_len + 1);
+    fields = malloc(sizeof(char *) * (header.num_fields ? header.num_fields : 1));
+    if (fread(names, header.names_len, 1, file) != 1 && header.names_len) {
+        free(names);
+        free(fields);
+        return NULL;
+    }
+    names[header.names_len] = '\0';
+    for (i = 0, p = names; i < header.num_fields; i++, p += strlen(p) + 1) {
+        if (p >= names + header.names_len) {
+            free(names);
+            free(fields);
+            return NULL;
+        }
+        fields[i] = p;
+    }
+
+    meta = meta_new(fields, header.num_fields);
+    meta->inode = header.inode;
+    meta->file = file;
+    free(names);
+    free(fields);
+
+    blocks_start = ftello(file);
+    while (fread(&block, sizeof(block), 1, file) == 1) {
+        if (fseeko(file, block.bytes, SEEK_CUR) == -1)
+            break;
+        if ((off_t) block.end_offset > meta->covered)
+            meta->covered = block.end_offset;
+    }
+    fseeko(file, blocks_start, SEEK_SET);
+    return meta;
+}
+
+/*
+ * a sidecar to add rows to.  with append, rows go on the end of the one that's
+ * there (if it's for this log and these fields); check meta->covered to see
+ * how far it already goes.
+ */
+ug_meta_t *ug_meta_create(char *fname, FILE * log, char **fields, int num_fields, int append)
+{
+    struct ug_meta_header header;
+    ug_meta_t *meta = NULL;
+    FILE *file;
+    int i, same;
+
+    if (append && (file = fopen(fname, "r"))) {
+        meta = meta_read_header(file);
+        fclose(file);
+        if (meta) {
+            meta->file = NULL;
+            same = meta->inode == log_inode(log) && meta->num_fields == num_fields;
+            for (i = 0; same && i < num_fields; i++)
+                same = strcmp(meta->fields[i], fields[i]) == 0;
+            if (same && (meta->file = fopen(fname, "a")))
+                return meta;
+            ug_meta_free(meta);
+        }
+    }
+
+    file = fopen(fname, "w");
+    if (!file) {
+        perror(fname);
+        return NULL;
+    }
+
+    meta = meta_new(fields, num_fields);
+    meta->file = file;
+    meta->inode = log_inode(log);
+
+    header.magic = UG_META_MAGIC;
+    header.num_fields = num_fields;
+    header.names_len = 0;
+    header.unused = 0;
+    header.inode = meta->inode;
+    for (i = 0; i < num_fields; i++)
+        header.names_len += strlen(fields[i]) + 1;
+    fwrite(&header, sizeof(header), 1, file);
+    for (i = 0; i < num_fields; i++)
+        fwrite(fields[i], strlen(fields[i]) + 1, 1, file);
+    return meta;
+}
+
+static void flush_block(ug_meta_t * meta)
+{
+    struct ug_meta_block_header block;
+    uint32_t i;
+    int f;
+
+    if (!meta->rows)
+        return;
+
+    block.rows = meta->rows;
+    block.bytes = meta->rows * (sizeof(uint64_t) * 2 + sizeof(uint32_t));
+    block.min_time = block.max_time = meta->times[0];
+    block.end_offset = 0;
+    for (i = 0; i < meta->rows; i++) {
+        if (meta->times[i] < block.min_time)
+            block.min_time = meta->times[i];
+        if (meta->times[i] > block.max_time)
+            block.max_time = meta->times[i];
+        if (meta->offsets[i] + meta->lengths[i] > block.end_offset)
+            block.end_offset = meta->offsets[i] + meta->lengths[i];
+    }
+    for (f = 0; f < meta->num_fields; f++)
+        block.bytes += meta->rows * sizeof(uint32_t) + meta->values_len[f];
+
+    fwrite(&block, sizeof(block), 1, meta->file);
+    fwrite(meta->times, sizeof(uint64_t), meta->rows, meta->file);
+    fwrite(meta->offsets, sizeof(uint64_t), meta->rows, meta->file);
+    fwrite(meta->lengths, sizeof(uint32_t), meta->rows, meta->file);
+    for (f = 0; f < meta->num_fields; f++) {
+        fwrite(meta->ends[f], sizeof(uint32_t), meta->rows, meta->file);
+        fwrite(meta->values[f], 1, meta->values_len[f], meta->file);
+        meta->values_len[f] = 0;
+    }
+    meta->rows = 0;
+}
+
+/* requests the sidecar already has (we're re-framing the end of a growing log) are skipped */
+void ug_meta_add(ug_meta_t * meta, request_t * req, char **values, size_t * lens)
+{
+    int f;
+
+    if (req->offset < meta->covered)
+        return;
+
+    meta->times[meta->rows] = req->time;
+    meta->offsets[meta->rows] = req->offset;
+    meta->lengths[meta->rows] = req->length;
+    for (f = 0; f < meta->num_fields; f++) {
+        reserve_values(meta, f, meta->values_len[f] + lens[f]);
+        memcpy(meta->values[f] + meta->values_len[f], values[f], lens[f]);
+        meta->values_len[f] += lens[f];
+        meta->ends[f][meta->rows] = meta->values_len[f];
+    }
+    meta->covered = req->offset + req->length;
+
+    if (++meta->rows == UG_META_BLOCK_ROWS)
+        flush_block(meta);
+}
+
+void ug_meta_close(ug_meta_t * meta)
+{
+    flush_block(meta);
+    ug_meta_free(meta);
+}
+
+/* the sidecar for log, or NULL if there's none (or it's for a different file) */
+ug_meta_t *ug_meta_open(char *fname, FILE * log)
+{
+    ug_meta_t *meta;
+    FILE *file;
+
+    file = fopen(fname, "r");
+    if (!file)
+        return NULL;
+
+    meta = meta_read_header(file);
+    if (!meta) {
+        fclose(file);
+        return NULL;
+    }
+    if (meta->inode != log_inode(log)) {
+        ug_meta_free(meta);
+        return NULL;
+    }
+    return meta;
+}
+
+/* load the next block with rows in the time range; returns its number of rows, 0 at the end */
+int ug_meta_read_block(ug_meta_t * meta, time_t start_time, time_t end_time)
+{
+    struct ug_meta_block_header block;
+    int f;
+
+    while (fread(&block, sizeof(block), 1, meta->file) == 1) {
+        if (block.rows > UG_META_BLOCK_ROWS)
+            break;
+
+        if (block.max_time < (uint64_t) start_time || block.min_time > (uint64_t) end_time) {
+            if (fseeko(meta->file, block.bytes, SEEK_CUR) == -1)
+                break;
+            continue;
+        }
+
+        meta->rows = block.rows;
+        if (fread(meta->times, sizeof(uint64_t), block.rows, meta->file) != block.rows
+            || fread(meta->offsets, sizeof(uint64_t), block.rows, meta->file) != block.rows
+            || fread(meta->lengths, sizeof(uint32_t), block.rows, meta->file) != block.rows)
+            break;
+
+        for (f = 0; f < meta->num_fields; f++) {
+            if (fread(meta->ends[f], sizeof(uint32_t), block.rows, meta->file) != block.rows)
+                return 0;
+            meta->values_len[f] = block.rows ? meta->ends[f][block.rows - 1] : 0;
+            reserve_values(meta, f, meta->values_len[f]);
+            if (fread(meta->values[f], 1, meta->values_len[f], meta->file) != meta->values_len[f])
+                return 0;
+        }
+        return block.rows;
+    }
+    meta->rows = 0;
+    return 0;
+}
+
+char *ug_meta_value(ug_meta_t * meta, int field, uint32_t row, size_t * len)
+{
+    uint32_t start = row ? meta->ends[field][row - 1] : 0;
+
+    *len = meta->ends[field][row] - start;
+    return meta->values[field] + start;
+}
+
+int ug_meta_field(ug_meta_t * meta, char *name)
+{
+    int f;
+
+    for (f = 0; f < meta->num_fields; f++) {
+        if (strcmp(meta->fields[f], name) == 0)
+            return f;
+    }
+    return -1;
+}
+
+void ug_meta_free(ug_meta_t * meta)
+{
+    int f;
+
+    if (meta->file)
+        fclose(meta->file);
+    for (f = 0; f < meta->num_fields; f++) {
+        free(meta->fields[f]);
+        free(meta->ends[f]);
+        free(meta->values[f]);
+    }
+    free(meta->fields);
+    free(meta->ends);
+    free(meta->values);
+    free(meta->values_len);
+    free(meta->values_allocated);
+    free(meta->times);
+    free(meta->offsets);
+    free(meta->lengths);
+    free(meta);
+}
+
+/* "status=500", "duration>2000", "action!=foo"; returns -1 if there's no name or operator */
+int ug_meta_parse_pred(char *arg, ug_meta_pred_t * pred)
+{
+    char *op, *end;
+    size_t op_len = 1;
+
+    op = strpbrk(arg, "=!<>");
+    if (!op || op == arg)
+        return -1;
+
+    if (op[0] == '!' && op[1] == '=') {
+        pred->op = UG_META_NE;
+        op_len = 2;
+    } else if (op[0] == '<') {
+        pred->op = op[1] == '=' ? UG_META_LE : UG_META_LT;
+        op_len = op[1] == '=' ? 2 : 1;
+    } else if (op[0] == '>') {
+        pred->op = op[1] == '=' ? UG_META_GE : UG_META_GT;
+        op_len = op[1] == '=' ? 2 : 1;
+    } else if (op[0] == '=') {
+        pred->op = UG_META_EQ;
+    } else {
+        return -1;
+    }
+
+    pred->name = strndup(arg, op - arg);
+    pred->value = strdup(op + op_len);
+    pred->field = -1;
+    pred->number = strtod(pred->value, &end);
+    pred->numeric = *pred->value && !*end;
+    return 0;
+}
+
+static int compare_result(int op, int cmp)
+{
+    switch (op) {
+        case UG_META_EQ:
+            return cmp == 0;
+        case UG_META_NE:
+            return cmp != 0;
+        case UG_META_LT:
+            return cmp < 0;
+        case UG_META_LE:
+            return cmp <= 0;
+        case UG_META_GT:
+            return cmp > 0;
+        default:
+            return cmp >= 0;
+    }
+}
+
+/* a value that's missing, or isn't a number when the test is against one, only passes "!=" */
+int ug_meta_test(ug_meta_pred_t * pred, char *value, size_t len)
+{
+    char buf[64], *end;
+    double number;
+    int cmp;
+
+    if (pred->numeric) {
+        if (!len || len >= sizeof(buf))
+            return pred->op == UG_META_NE;
+        memcpy(buf, value, len);
+        buf[len] = '\0';
+        number = strtod(buf, &end);
+        if (*end)
+            return pred->op == UG_META_NE;
+        return compare_result(pred->op, number < pred->number ? -1 : number > pred->number);
+    }
+
+    cmp = strncmp(value, pred->value, len);
+    if (cmp == 0)
+        cmp = len < strlen(pred->value) ? -1 : 0;
+    return compare_result(pred->op, cmp);
+}
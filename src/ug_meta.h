@@ -0,0 +1,64 @@
+#ifndef _UG_META_H
+#define _UG_META_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "request.h"
+
+/*
+ * the .meta sidecar, which ug_build_index writes when it's told which fields
+ * to pull out of each request: one row per request, with its time, offset and
+ * length and the value of each field (empty if the request doesn't have it).
+ * fields are named by the whole "name=regexp" they were built with, so
+ * values pulled out with an older regexp don't answer for a newer one.
+ * rows are stored a block at a time, column after column, so a query can skip
+ * whole blocks outside its time range and only the rows that pass its field
+ * predicates have to be read from the log.
+ */
+#define UG_META_BLOCK_ROWS 4096
+
+typedef struct {
+    FILE *file;
+    int num_fields;
+    char **fields;
+    uint64_t inode;             /* of the log the rows are for */
+    off_t covered;              /* the rows cover the log up to here */
+
+    /* the block being filled or read */
+    uint32_t rows;
+    uint64_t *times;
+    uint64_t *offsets;
+    uint32_t *lengths;
+    uint32_t **ends;            /* per field, where each row's value ends in values[field] */
+    char **values;
+    size_t *values_len;
+    size_t *values_allocated;
+} ug_meta_t;
+
+/* a "field=value" style test; numbers compare as numbers */
+enum { UG_META_EQ, UG_META_NE, UG_META_LT, UG_META_LE, UG_META_GT, UG_META_GE };
+
+typedef struct {
+    char *name;
+    int field;                  /* in the sidecar, or in the caller's own list of fields */
+    int op;
+    char *value;
+    int numeric;
+    double number;
+} ug_meta_pred_t;
+
+ug_meta_t *ug_meta_create(char *fname, FILE * log, char **fields, int num_fields, int append);
+void ug_meta_add(ug_meta_t * meta, request_t * req, char **values, size_t * lens);
+void ug_meta_close(ug_meta_t * meta);
+
+ug_meta_t *ug_meta_open(char *fname, FILE * log);
+int ug_meta_read_block(ug_meta_t * meta, time_t start_time, time_t end_time);
+char *ug_meta_value(ug_meta_t * meta, int field, uint32_t row, size_t * len);
+int ug_meta_field(ug_meta_t * meta, char *name);
+void ug_meta_free(ug_meta_t * meta);
+
+int ug_meta_parse_pred(char *arg, ug_meta_pred_t * pred);
+int ug_meta_test(ug_meta_pred_t * pred, char *value, size_t len);
+
+#endif
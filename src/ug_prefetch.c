@@ -0,0 +1,49 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ug_index.h"
+#include "ug_gzip.h"
+#include "ug_prefetch.h"
+
+/*
+ * the driver tells a worker which log it'll most likely search next.  we ask
+ * the kernel to start reading it from where the search will start (the index
+ * entry for start_time, or for gzipped logs the access point before that), so
+ * the disk gets to it while we're still matching the current one.
+ */
+void ug_prefetch(char *log_fname, time_t start_time)
+{
+    FILE *index, *gz_index;
+    off_t offset = 0, compressed_offset, access_point;
+    unsigned char *dict;
+    int fd;
+
+    fd = open(log_fname, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    index = fopen(ug_get_index_fname(log_fname, "idx"), "r");
+    if (index) {
+        offset = ug_get_offset_for_timestamp(index, start_time);
+        fclose(index);
+    }
+
+    if (strlen(log_fname) > 3 && strcmp(log_fname + strlen(log_fname) - 3, ".gz") == 0) {
+        gz_index = index ? fopen(ug_get_index_fname(log_fname, "gzidx"), "r") : NULL;
+        dict = malloc(WINSIZE);
+        if (gz_index && fill_gz_info(offset, gz_index, dict, &compressed_offset, &access_point))
+            offset = compressed_offset & 0x00FFFFFFFFFFFFFF;
+        else
+            offset = 0;
+        free(dict);
+        if (gz_index)
+            fclose(gz_index);
+    }
+
+    posix_fadvise(fd, offset, UG_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    close(fd);
+}
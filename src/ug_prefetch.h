@@ -0,0 +1,11 @@
+#ifndef _UG_PREFETCH_H
+#define _UG_PREFETCH_H
+
+#include <time.h>
+
+/* how much of the next log to get into the page cache ahead of time */
+#define UG_PREFETCH_BYTES (32 * 1024 * 1024)
+
+void ug_prefetch(char *log_fname, time_t start_time);
+
+#endif
@@ -0,0 +1,82 @@
+// ex: set softtabstop=4 shiftwidth=4 tabstop=4 expandtab:
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "ug_utf8.h"
+
+#define HIGH_BITS 0x8080808080808080ULL
+
+/*
+ * logs are almost all ASCII, so we check eight bytes at a time until we hit
+ * one with the high bit set, and only then look at multi-byte sequences.
+ * overlong forms, surrogates and anything past U+10FFFF count as invalid,
+ * same as ruby's String#encode.
+ */
+size_t ug_utf8_valid_prefix(const char *str, size_t len)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned char c, lo, hi;
+    uint64_t word;
+    size_t i = 0, n, j;
+
+    while ( i < len ) {
+        while ( i + 8 <= len ) {
+            memcpy(&word, s + i, 8);
+            if ( word & HIGH_BITS )
+                break;
+            i += 8;
+        }
+        if ( i == len )
+            break;
+
+        c = s[i];
+        if ( c < 0x80 ) {
+            i++;
+            continue;
+        }
+
+        /* the length of the sequence, and the range its second byte has to be in */
+        lo = 0x80, hi = 0xBF;
+        if ( c >= 0xC2 && c <= 0xDF )
+            n = 2;
+        else if ( c >= 0xE0 && c <= 0xEF ) {
+            n = 3;
+            if ( c == 0xE0 ) lo = 0xA0;
+            if ( c == 0xED ) hi = 0x9F;
+        } else if ( c >= 0xF0 && c <= 0xF4 ) {
+            n = 4;
+            if ( c == 0xF0 ) lo = 0x90;
+            if ( c == 0xF4 ) hi = 0x8F;
+        } else
+            return i;
+
+        if ( i + n > len || s[i + 1] < lo || s[i + 1] > hi )
+            return i;
+        for (j = 2; j < n; j++) {
+            if ( (s[i + j] & 0xC0) != 0x80 )
+                return i;
+        }
+        i += n;
+    }
+    return len;
+}
+
+/*
+ * dropping one bad byte at a time comes out the same as dropping whole broken
+ * sequences: what follows a broken lead byte are continuation bytes, and those
+ * are never valid on their own.
+ */
+void ug_utf8_write(const char *s, size_t len, FILE * out)
+{
+    size_t n;
+
+    while ( len > 0 ) {
+        n = ug_utf8_valid_prefix(s, len);
+        fwrite(s, n, 1, out);
+        if ( n == len )
+            return;
+        s += n + 1;
+        len -= n + 1;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef _UG_UTF8_H
+#define _UG_UTF8_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* how many bytes at the start of s are valid UTF-8 */
+size_t ug_utf8_valid_prefix(const char *s, size_t len);
+
+/* write s to out, leaving out any bytes that aren't valid UTF-8 */
+void ug_utf8_write(const char *s, size_t len, FILE * out);
+
+#endif